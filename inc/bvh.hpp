@@ -1,15 +1,23 @@
 #ifndef HW4_BVH_HPP
 #define HW4_BVH_HPP
 
+#include <cassert>
+#include <cmath>
 #include <deque>
 #include <functional>
+#include <future>
+#include <iterator>
 #include <limits>
 #include <memory>
+#include <ostream>
+#include <stdexcept>
 #include <vector>
 
 #include <glm/glm.hpp>
 
+#include "parallel.hpp"
 #include "ray.hpp"
+#include "simd.hpp"
 
 namespace hw4 {
     class BoundingBox {
@@ -68,6 +76,95 @@ namespace hw4 {
             return tmax >= tmin && tmax > 0;
         }
 
+        // Checks whether the given ray enters this box before max_distance, storing the distance at
+        // which it does so (0 if the ray starts inside the box) in distance.
+        bool intersects(const Ray& r, float max_distance, float& distance) const {
+            float tmin, tmax;
+
+            {
+                float tx1 = (this->m_min.x - r.origin().x) * r.inv_direction().x;
+                float tx2 = (this->m_max.x - r.origin().x) * r.inv_direction().x;
+
+                tmin = std::min(tx1, tx2);
+                tmax = std::max(tx1, tx2);
+            }
+
+            {
+                float ty1 = (this->m_min.y - r.origin().y) * r.inv_direction().y;
+                float ty2 = (this->m_max.y - r.origin().y) * r.inv_direction().y;
+
+                tmin = std::max(tmin, std::min(ty1, ty2));
+                tmax = std::min(tmax, std::max(ty1, ty2));
+            }
+
+            {
+                float tz1 = (this->m_min.z - r.origin().z) * r.inv_direction().z;
+                float tz2 = (this->m_max.z - r.origin().z) * r.inv_direction().z;
+
+                tmin = std::max(tmin, std::min(tz1, tz2));
+                tmax = std::min(tmax, std::max(tz1, tz2));
+            }
+
+            distance = std::max(tmin, 0.0f);
+
+            return tmax >= tmin && tmax > 0 && distance <= max_distance;
+        }
+
+        // Conservatively checks whether any ray in the given packet could hit this box, using
+        // interval arithmetic on the bounds of the packet's origins and inverse directions. This is
+        // only valid for coherent packets.
+        bool may_intersect(const RayPacket& p) const {
+            assert(p.coherent());
+
+            float tmin = 0;
+            float tmax = std::numeric_limits<float>::infinity();
+
+            for (int i = 0; i < 3; i++) {
+                bool negative = p.inv_direction_min()[i] < 0;
+                float near = negative ? this->m_max[i] : this->m_min[i];
+                float far = negative ? this->m_min[i] : this->m_max[i];
+
+                float inv_lo = p.inv_direction_min()[i];
+                float inv_hi = p.inv_direction_max()[i];
+
+                float near_lo = near - p.origin_max()[i];
+                float near_hi = near - p.origin_min()[i];
+                float far_lo = far - p.origin_max()[i];
+                float far_hi = far - p.origin_min()[i];
+
+                tmin = std::max(tmin, std::min(
+                    std::min(near_lo * inv_lo, near_lo * inv_hi),
+                    std::min(near_hi * inv_lo, near_hi * inv_hi)
+                ));
+                tmax = std::min(tmax, std::max(
+                    std::max(far_lo * inv_lo, far_lo * inv_hi),
+                    std::max(far_hi * inv_lo, far_hi * inv_hi)
+                ));
+            }
+
+            return tmin <= tmax;
+        }
+
+        float surface_area() const {
+            auto s = this->size();
+
+            return 2 * (s.x * s.y + s.y * s.z + s.z * s.x);
+        }
+
+        bool is_empty() const {
+            return this->m_min.x > this->m_max.x
+                || this->m_min.y > this->m_max.y
+                || this->m_min.z > this->m_max.z;
+        }
+
+        // A box containing nothing, which acts as the identity for combine
+        static BoundingBox empty() {
+            return BoundingBox(
+                glm::vec3(std::numeric_limits<float>::infinity()),
+                glm::vec3(-std::numeric_limits<float>::infinity())
+            );
+        }
+
         static BoundingBox combine(BoundingBox a, BoundingBox b) {
             return BoundingBox(
                 glm::vec3(
@@ -82,6 +179,22 @@ namespace hw4 {
                 )
             );
         }
+
+        // The box contained in both a and b, which is empty if they don't overlap
+        static BoundingBox intersection(BoundingBox a, BoundingBox b) {
+            return BoundingBox(
+                glm::vec3(
+                    std::max(a.min().x, b.min().x),
+                    std::max(a.min().y, b.min().y),
+                    std::max(a.min().z, b.min().z)
+                ),
+                glm::vec3(
+                    std::min(a.max().x, b.max().x),
+                    std::min(a.max().y, b.max().y),
+                    std::min(a.max().z, b.max().z)
+                )
+            );
+        }
     };
 
     BoundingBox operator *(const glm::mat4& m, const BoundingBox& b);
@@ -107,19 +220,27 @@ namespace hw4 {
         return split_by_3(x) | (split_by_3(y) << 1) | (split_by_3(z) << 2);
     }
 
-    inline uint64_t morton_code(const glm::vec3& pos) {
+    // Scales a position within the unit cube to the full range of a uint32_t on each axis
+    inline glm::uvec3 morton_quantize(const glm::vec3& pos) {
         assert(pos.x >= 0 && pos.x <= 1);
         assert(pos.y >= 0 && pos.y <= 1);
         assert(pos.z >= 0 && pos.z <= 1);
 
-        return morton_code(
+        return glm::uvec3(
             static_cast<uint32_t>(pos.x * std::numeric_limits<uint32_t>::max()),
             static_cast<uint32_t>(pos.y * std::numeric_limits<uint32_t>::max()),
             static_cast<uint32_t>(pos.z * std::numeric_limits<uint32_t>::max())
         );
     }
 
-    inline uint64_t morton_code(const BoundingBox& b, const BoundingBox& total) {
+    inline uint64_t morton_code(const glm::vec3& pos) {
+        auto q = morton_quantize(pos);
+
+        return morton_code(q.x, q.y, q.z);
+    }
+
+    // Finds the position of the center of b within total, scaled to the unit cube
+    inline glm::vec3 morton_position(const BoundingBox& b, const BoundingBox& total) {
         auto v = (b.center() - total.min()) / (total.max() - total.min());
 
         // Deal with possible divisions by 0
@@ -135,186 +256,1800 @@ namespace hw4 {
             v.z = 0;
         }
 
-        return morton_code(v);
+        return v;
+    }
+
+    inline uint64_t morton_code(const BoundingBox& b, const BoundingBox& total) {
+        return morton_code(morton_position(b, total));
     }
 
+    enum class BVHBuildMethod {
+        aac,
+        sah,
+
+        // Like sah, but objects which straddle a split may be referenced from both sides of it
+        // (see BVH::construct_sbvh)
+        sbvh
+    };
+
+    struct BVHBuildOptions {
+        BVHBuildMethod method = BVHBuildMethod::aac;
+
+        // The number of objects below which AAC construction stops partitioning by Morton code and
+        // starts clustering
+        size_t delta = 20;
+
+        // The number of children per node used for traversal (2, 4, or 8). Wider trees are built by
+        // collapsing the binary tree produced by the builder.
+        size_t width = 4;
+
+        // The largest number of objects that can be placed in a single leaf. Subtrees with at most
+        // this many objects are turned into leaves where the SAH says that doing so is cheaper.
+        size_t max_leaf_size = 8;
+
+        // Whether wide nodes should be stored in a compressed form (see QuantizedWideBVHNode),
+        // which uses roughly half as much memory at the cost of some extra work during traversal
+        bool quantize = false;
+
+        // The number of extra object references that the sbvh builder may create by splitting
+        // objects, as a fraction of the number of objects
+        float split_budget = 0.3f;
+    };
+
+    // Measurements of the shape and quality of a BVH, used for tuning and debugging the builders
+    struct BVHStats {
+        size_t nodes = 0;
+        size_t leaves = 0;
+        size_t max_depth = 0;
+
+        // The average depth of the leaves of the tree
+        float average_depth = 0;
+
+        // See BVH::sah_cost
+        float sah_cost = 0;
+
+        // The total surface area of the overlap between the children of each interior node,
+        // relative to the surface area of the root
+        float sibling_overlap = 0;
+
+        // The number of bytes used by the nodes and object lists of the tree
+        size_t memory = 0;
+    };
+
+    struct MortonKey {
+        uint64_t code;
+        uint32_t index;
+    };
+
+    // Computes the Morton code of each of the given boxes within total in parallel, using BMI2
+    // instructions where the CPU supports them
+    void compute_morton_keys(
+        const std::vector<BoundingBox>& boxes,
+        const BoundingBox& total,
+        std::vector<MortonKey>& keys
+    );
+
+    // Sorts the given keys by Morton code using a parallel radix sort
+    void sort_morton_keys(std::vector<MortonKey>& keys);
+
+    // A BVH node with N children whose bounds are stored one plane at a time, so that a ray can be
+    // tested against all of the children at once using SIMD instructions.
+    template <size_t N>
+    struct WideBVHNode {
+        typedef typename simd::float_n<N>::type floatn;
+
+        static constexpr size_t width = N;
+
+        // A ray with its components broadcast for testing against a node
+        struct TraversalRay {
+            floatn origin_x, origin_y, origin_z;
+            floatn inv_direction_x, inv_direction_y, inv_direction_z;
+            bool negative_x, negative_y, negative_z;
+
+            TraversalRay(const Ray& r)
+                : origin_x(r.origin().x), origin_y(r.origin().y), origin_z(r.origin().z),
+                  inv_direction_x(r.inv_direction().x), inv_direction_y(r.inv_direction().y),
+                  inv_direction_z(r.inv_direction().z), negative_x(r.inv_direction().x < 0),
+                  negative_y(r.inv_direction().y < 0), negative_z(r.inv_direction().z < 0) {}
+        };
+
+        float min_x[N];
+        float min_y[N];
+        float min_z[N];
+        float max_x[N];
+        float max_y[N];
+        float max_z[N];
+
+        // For interior children, the index of the child node. For leaf children, the index of the
+        // first object in the leaf.
+        uint32_t child[N];
+
+        // The number of objects in each child, which is 0 for interior children.
+        uint32_t count[N];
+
+        // A bitmask of the slots which hold a child. Unused slots also have an empty box, but
+        // intersection results are masked with this as well so that a ray which slips through the
+        // slab test (e.g. one with NaN components) can never visit them.
+        unsigned int valid = 0;
+
+        void set_child(size_t i, const BoundingBox& box, uint32_t child, uint32_t count) {
+            this->min_x[i] = box.min().x;
+            this->min_y[i] = box.min().y;
+            this->min_z[i] = box.min().z;
+            this->max_x[i] = box.max().x;
+            this->max_y[i] = box.max().y;
+            this->max_z[i] = box.max().z;
+
+            this->child[i] = child;
+            this->count[i] = count;
+            this->valid |= 1u << i;
+        }
+
+        void set_empty(size_t i) {
+            this->set_child(i, BoundingBox::empty(), 0, 0);
+            this->valid &= ~(1u << i);
+        }
+
+        BoundingBox child_box(size_t i) const {
+            return BoundingBox(
+                glm::vec3(this->min_x[i], this->min_y[i], this->min_z[i]),
+                glm::vec3(this->max_x[i], this->max_y[i], this->max_z[i])
+            );
+        }
+
+        // Returns a bitmask of the children which the ray enters before max_distance, storing the
+        // distance at which it enters each of them in distances.
+        unsigned int intersect(const TraversalRay& r, float max_distance, float* distances) const {
+            // Picking the near and far planes based on the direction of the ray means that empty
+            // boxes (with min > max) are always missed.
+            floatn tx0 = (floatn::load(r.negative_x ? this->max_x : this->min_x) - r.origin_x) * r.inv_direction_x;
+            floatn tx1 = (floatn::load(r.negative_x ? this->min_x : this->max_x) - r.origin_x) * r.inv_direction_x;
+            floatn ty0 = (floatn::load(r.negative_y ? this->max_y : this->min_y) - r.origin_y) * r.inv_direction_y;
+            floatn ty1 = (floatn::load(r.negative_y ? this->min_y : this->max_y) - r.origin_y) * r.inv_direction_y;
+            floatn tz0 = (floatn::load(r.negative_z ? this->max_z : this->min_z) - r.origin_z) * r.inv_direction_z;
+            floatn tz1 = (floatn::load(r.negative_z ? this->min_z : this->max_z) - r.origin_z) * r.inv_direction_z;
+
+            floatn tmin = simd::max(simd::max(tx0, ty0), simd::max(tz0, floatn(0.0f)));
+            floatn tmax = simd::min(simd::min(tx1, ty1), simd::min(tz1, floatn(max_distance)));
+
+            tmin.store(distances);
+
+            return simd::less_equal(tmin, tmax) & this->valid;
+        }
+    };
+
+    // A compressed version of WideBVHNode which stores the bounds of its children as 8-bit
+    // multiples of a power of two relative to the minimum corner of the node. Bounds are rounded
+    // outwards when quantized, so the decoded boxes always contain the original ones.
+    template <size_t N>
+    struct QuantizedWideBVHNode {
+        typedef typename simd::float_n<N>::type floatn;
+        typedef typename WideBVHNode<N>::TraversalRay TraversalRay;
+
+        static constexpr size_t width = N;
+
+        float origin[3];
+        float scale[3];
+
+        uint8_t min_x[N];
+        uint8_t min_y[N];
+        uint8_t min_z[N];
+        uint8_t max_x[N];
+        uint8_t max_y[N];
+        uint8_t max_z[N];
+
+        uint32_t child[N];
+        uint32_t count[N];
+        unsigned int valid;
+
+        QuantizedWideBVHNode(const WideBVHNode<N>& n) : valid(n.valid) {
+            auto box = BoundingBox::empty();
+
+            for (size_t i = 0; i < N; i++) {
+                box = BoundingBox::combine(box, n.child_box(i));
+            }
+
+            for (int a = 0; a < 3; a++) {
+                // Use the smallest power of two which lets 255 steps span the whole node, so that
+                // multiplying by it is exact.
+                float extent = box.max()[a] - box.min()[a];
+                int exponent;
+
+                std::frexp(extent / 255, &exponent);
+
+                this->origin[a] = box.min()[a];
+                this->scale[a] = extent > 0 ? std::ldexp(1.0f, exponent) : 1.0f;
+            }
+
+            for (size_t i = 0; i < N; i++) {
+                auto b = n.child_box(i);
+
+                if (b.is_empty()) {
+                    this->set_empty(i);
+                } else {
+                    this->min_x[i] = this->quantize_min(0, b.min().x);
+                    this->min_y[i] = this->quantize_min(1, b.min().y);
+                    this->min_z[i] = this->quantize_min(2, b.min().z);
+                    this->max_x[i] = this->quantize_max(0, b.max().x);
+                    this->max_y[i] = this->quantize_max(1, b.max().y);
+                    this->max_z[i] = this->quantize_max(2, b.max().z);
+                }
+
+                this->child[i] = n.child[i];
+                this->count[i] = n.count[i];
+            }
+        }
+
+        float dequantize(int axis, uint8_t q) const {
+            return this->origin[axis] + q * this->scale[axis];
+        }
+
+        BoundingBox child_box(size_t i) const {
+            return BoundingBox(
+                glm::vec3(
+                    this->dequantize(0, this->min_x[i]),
+                    this->dequantize(1, this->min_y[i]),
+                    this->dequantize(2, this->min_z[i])
+                ),
+                glm::vec3(
+                    this->dequantize(0, this->max_x[i]),
+                    this->dequantize(1, this->max_y[i]),
+                    this->dequantize(2, this->max_z[i])
+                )
+            );
+        }
+
+        unsigned int intersect(const TraversalRay& r, float max_distance, float* distances) const {
+            floatn origin_x(this->origin[0]), origin_y(this->origin[1]), origin_z(this->origin[2]);
+            floatn scale_x(this->scale[0]), scale_y(this->scale[1]), scale_z(this->scale[2]);
+
+            auto plane = [](const uint8_t* q, floatn origin, floatn scale, const floatn& ray_origin) {
+                return origin + floatn::load_u8(q) * scale - ray_origin;
+            };
+
+            floatn tx0 = plane(r.negative_x ? this->max_x : this->min_x, origin_x, scale_x, r.origin_x) * r.inv_direction_x;
+            floatn tx1 = plane(r.negative_x ? this->min_x : this->max_x, origin_x, scale_x, r.origin_x) * r.inv_direction_x;
+            floatn ty0 = plane(r.negative_y ? this->max_y : this->min_y, origin_y, scale_y, r.origin_y) * r.inv_direction_y;
+            floatn ty1 = plane(r.negative_y ? this->min_y : this->max_y, origin_y, scale_y, r.origin_y) * r.inv_direction_y;
+            floatn tz0 = plane(r.negative_z ? this->max_z : this->min_z, origin_z, scale_z, r.origin_z) * r.inv_direction_z;
+            floatn tz1 = plane(r.negative_z ? this->min_z : this->max_z, origin_z, scale_z, r.origin_z) * r.inv_direction_z;
+
+            floatn tmin = simd::max(simd::max(tx0, ty0), simd::max(tz0, floatn(0.0f)));
+            floatn tmax = simd::min(simd::min(tx1, ty1), simd::min(tz1, floatn(max_distance)));
+
+            tmin.store(distances);
+
+            return simd::less_equal(tmin, tmax) & this->valid;
+        }
+    private:
+        uint8_t quantize_min(int axis, float v) const {
+            float q = std::floor((v - this->origin[axis]) / this->scale[axis]);
+            auto result = static_cast<uint8_t>(std::min(std::max(q, 0.0f), 255.0f));
+
+            while (result > 0 && this->dequantize(axis, result) > v) result--;
+            return result;
+        }
+
+        uint8_t quantize_max(int axis, float v) const {
+            float q = std::ceil((v - this->origin[axis]) / this->scale[axis]);
+            auto result = static_cast<uint8_t>(std::min(std::max(q, 0.0f), 255.0f));
+
+            while (result < 255 && this->dequantize(axis, result) < v) result++;
+            return result;
+        }
+
+        // Unused slots get a box whose minimum is above its maximum on every axis, which rays
+        // never hit for the same reason as in WideBVHNode.
+        void set_empty(size_t i) {
+            this->min_x[i] = this->min_y[i] = this->min_z[i] = 255;
+            this->max_x[i] = this->max_y[i] = this->max_z[i] = 0;
+        }
+    };
+
+    // A stack of nodes deferred during traversal. Stacks for trees of typical depth fit in a
+    // fixed-size array, but deeper trees are perfectly valid and get a stack on the heap instead.
+    template <typename TEntry, size_t InlineCapacity>
+    class TraversalStack {
+        TEntry m_inline[InlineCapacity];
+        std::unique_ptr<TEntry[]> m_heap;
+        TEntry* m_entries;
+        size_t m_capacity;
+    public:
+        explicit TraversalStack(size_t capacity) : m_entries(m_inline), m_capacity(InlineCapacity) {
+            if (capacity > InlineCapacity) {
+                this->m_heap = std::make_unique<TEntry[]>(capacity);
+                this->m_entries = this->m_heap.get();
+                this->m_capacity = capacity;
+            }
+        }
+
+        TraversalStack(const TraversalStack& other) = delete;
+
+        TraversalStack& operator =(const TraversalStack& other) = delete;
+
+        TEntry& operator [](size_t i) {
+            assert(i < this->m_capacity);
+            return this->m_entries[i];
+        }
+    };
+
     template <class T>
     class BVH {
     public:
+        // Nodes are stored in a single array in depth-first order, so the left child of an interior
+        // node is always the node immediately following it.
         struct Node {
             BoundingBox box;
 
-            std::unique_ptr<Node> left;
-            std::unique_ptr<Node> right;
-
-            T* object = nullptr;
+            // For interior nodes, this is the index of the right child. For leaf nodes, this is the
+            // index of the first object in the leaf.
+            uint32_t offset;
 
-            template <typename TFn>
-            void search(const Ray& r, const TFn& fn) const {
-                if (this->box.intersects(r)) {
-                    if (this->object) {
-                        fn(*this->object);
-                    }
+            // The number of objects in this node, which is always 0 for interior nodes.
+            uint32_t count;
 
-                    if (this->left) this->left->search(r, fn);
-                    if (this->right) this->right->search(r, fn);
-                }
-            }
+            bool is_leaf() const { return this->count != 0; }
         };
+
+        static_assert(sizeof(Node) == 32, "BVH nodes should fit in half of a cache line");
+
+        // The depth of tree whose traversal stack fits in a fixed-size array. Trees can be deeper,
+        // but the top-down builders fall back to median splits past half of this to stay within it.
+        static constexpr size_t inline_depth = 128;
+
+        // The number of objects below which construction isn't worth splitting across threads
+        static constexpr size_t parallel_min_objects = 16384;
+
+        // The relative costs of visiting an interior node and of testing a ray against an object,
+        // used when estimating how expensive a tree is to trace
+        static constexpr float traversal_cost = 1.0f;
+        static constexpr float intersection_cost = 1.0f;
     private:
-        std::unique_ptr<Node> m_root;
+        // Nodes used during construction before the tree is flattened into its final layout
+        struct BuildNode {
+            BoundingBox box;
+
+            std::unique_ptr<BuildNode> left;
+            std::unique_ptr<BuildNode> right;
+
+            T* object = nullptr;
+
+            // Filled in by construct_choose_leaves once the tree has been built
+            size_t count = 1;
+            float cost = 0;
+            bool make_leaf = true;
+        };
+
+        std::vector<Node> m_nodes;
+        std::vector<T*> m_objects;
+
+        // The depth of the deepest node, with the root at depth 0. The traversal stacks are sized
+        // from this, since a ray can defer at most one node per level of a binary tree (or N - 1
+        // per level of an N-wide tree, which is never deeper than the binary one).
+        size_t m_depth = 0;
+
+        // Wide versions of the tree collapsed from m_nodes. At most one of these is used, and if
+        // all of them are empty then m_nodes is traversed directly.
+        std::vector<WideBVHNode<4>> m_wide4_nodes;
+        std::vector<WideBVHNode<8>> m_wide8_nodes;
+        std::vector<QuantizedWideBVHNode<4>> m_quantized4_nodes;
+        std::vector<QuantizedWideBVHNode<8>> m_quantized8_nodes;
+        size_t m_width = 2;
+        bool m_quantize = false;
+
+        // The SAH cost of the tree when it was built, which refitting is measured against
+        float m_build_cost = 0;
     public:
-        BVH() : m_root(nullptr) {}
-        BVH(std::unique_ptr<Node> root) : m_root(std::move(root)) {}
+        BVH() {}
 
-        const std::unique_ptr<Node>& root() const { return this->m_root; }
+        const std::vector<Node>& nodes() const { return this->m_nodes; }
+        const std::vector<T*>& objects() const { return this->m_objects; }
 
-        template <typename TFn>
-        void search(const Ray& r, const TFn& fn) const {
-            if (this->m_root) {
-                this->m_root->search(r, fn);
+        // Points the tree at a copy of its objects which has been laid out contiguously in the
+        // order given by objects(), so that every leaf refers to a contiguous range of the copy.
+        void relocate_objects(T* objects) {
+            for (size_t i = 0; i < this->m_objects.size(); i++) {
+                this->m_objects[i] = objects + i;
             }
         }
 
-        // Construction is done using approximate agglomerative clustering based off of
-        // http://graphics.cs.cmu.edu/projects/aac/aac_build.pdf
-        template <typename TAABBFn>
-        static BVH<T> construct(
-            const std::vector<T*>& objects,
-            size_t delta,
-            const TAABBFn& aabb
-        ) {
-            if (objects.empty()) return BVH<T>();
+        // Estimates the expected cost of tracing a random ray which hits the root of the tree using
+        // the surface area heuristic
+        float sah_cost() const {
+            if (this->m_nodes.empty()) return 0;
 
-            std::vector<std::tuple<T*, BoundingBox, uint64_t>> objects_sorted;
-            auto box = BoundingBox(
-                glm::vec3(std::numeric_limits<float>::infinity()),
-                glm::vec3(-std::numeric_limits<float>::infinity())
-            );
+            float root_area = this->m_nodes[0].box.surface_area();
+            float cost = 0;
 
-            for (T* o : objects) {
-                auto o_box = aabb(*o);
+            for (const auto& n : this->m_nodes) {
+                // If the root has no area then all of the objects are degenerate, and any ray
+                // which hits the root hits all of them
+                float p = root_area > 0 ? n.box.surface_area() / root_area : 1;
 
-                objects_sorted.emplace_back(o, o_box, 0);
-                box = BoundingBox::combine(box, o_box);
+                if (n.is_leaf()) {
+                    cost += p * n.count * intersection_cost;
+                } else {
+                    cost += p * traversal_cost;
+                }
             }
 
-            for (auto& o : objects_sorted) {
-                std::get<2>(o) = morton_code(std::get<1>(o), box);
-            }
+            return cost;
+        }
 
-            std::sort(objects_sorted.begin(), objects_sorted.end(), [](const auto& t1, const auto& t2) {
-                return std::get<2>(t1) < std::get<2>(t2);
-            });
+        BVHStats stats() const {
+            struct StackEntry {
+                uint32_t node;
+                size_t depth;
+            };
 
-            return BVH<T>(construct_build_tree(
-                objects_sorted,
-                0,
-                objects_sorted.size(),
-                delta,
-                62 // The top bit of the morton code we produce is always 0, so just ignore it
-            ));
-        }
-    private:
-        static std::unique_ptr<Node> construct_build_tree(
-            const std::vector<std::tuple<T*, BoundingBox, uint64_t>>& objects,
-            size_t start,
-            size_t end,
-            size_t delta,
-            int bit
-        ) {
-            if (start == end) return nullptr;
+            BVHStats stats;
 
-            if ((end - start) <= delta || bit < 0) {
-                return construct_combine_primitives(objects, start, end);
-            } else {
-                size_t part = construct_make_partition(objects, start, end, bit);
+            stats.nodes = this->m_nodes.size();
+            stats.sah_cost = this->sah_cost();
+            stats.memory = this->m_nodes.size() * sizeof(Node)
+                + this->m_objects.size() * sizeof(T*)
+                + this->m_wide4_nodes.size() * sizeof(WideBVHNode<4>)
+                + this->m_wide8_nodes.size() * sizeof(WideBVHNode<8>)
+                + this->m_quantized4_nodes.size() * sizeof(QuantizedWideBVHNode<4>)
+                + this->m_quantized8_nodes.size() * sizeof(QuantizedWideBVHNode<8>);
 
-                if (part == start || part == end) {
-                    return construct_build_tree(objects, start, end, delta, bit - 1);
-                } else {
-                    auto n = std::make_unique<Node>();
+            if (this->m_nodes.empty()) return stats;
+
+            float root_area = this->m_nodes[0].box.surface_area();
+            size_t total_depth = 0;
+            std::vector<StackEntry> stack { StackEntry { 0, 0 } };
+
+            while (!stack.empty()) {
+                auto e = stack.back();
+                const Node& n = this->m_nodes[e.node];
 
-                    n->left = construct_build_tree(objects, start, part, delta, bit - 1);
-                    n->right = construct_build_tree(objects, part, end, delta, bit - 1);
+                stack.pop_back();
+                stats.max_depth = std::max(stats.max_depth, e.depth);
 
-                    n->box = BoundingBox::combine(n->left->box, n->right->box);
+                if (n.is_leaf()) {
+                    stats.leaves++;
+                    total_depth += e.depth;
+                } else {
+                    auto overlap = BoundingBox::intersection(
+                        this->m_nodes[e.node + 1].box,
+                        this->m_nodes[n.offset].box
+                    );
+
+                    if (!overlap.is_empty() && root_area > 0) {
+                        stats.sibling_overlap += overlap.surface_area() / root_area;
+                    }
 
-                    return std::move(n);
+                    stack.push_back(StackEntry { e.node + 1, e.depth + 1 });
+                    stack.push_back(StackEntry { n.offset, e.depth + 1 });
                 }
             }
+
+            stats.average_depth = static_cast<float>(total_depth) / stats.leaves;
+
+            return stats;
         }
 
-        static size_t construct_make_partition(
-            const std::vector<std::tuple<T*, BoundingBox, uint64_t>>& objects,
-            size_t start,
-            size_t end,
-            int bit
-        ) {
-            uint64_t bitmask = 1 << bit;
+        // Writes the binary tree to the given stream with one node per line, in the same order as
+        // they're stored. Each line contains the index of the node, its depth, its bounding box,
+        // and either "node <right child>" or "leaf <first object> <object count>".
+        void dump(std::ostream& s) const {
+            std::vector<size_t> depths(this->m_nodes.size());
 
-            while (start < end) {
-                size_t mid = start + (end - start) / 2;
+            for (size_t i = 0; i < this->m_nodes.size(); i++) {
+                const Node& n = this->m_nodes[i];
+                const auto& min = n.box.min();
+                const auto& max = n.box.max();
 
-                if ((std::get<2>(objects[start]) & bitmask) == 0) {
-                    start = mid + 1;
+                s << i << ' ' << depths[i] << ' '
+                  << min.x << ' ' << min.y << ' ' << min.z << ' '
+                  << max.x << ' ' << max.y << ' ' << max.z << ' ';
+
+                if (n.is_leaf()) {
+                    s << "leaf " << n.offset << ' ' << n.count << '\n';
                 } else {
-                    end = mid;
+                    depths[i + 1] = depths[n.offset] = depths[i] + 1;
+                    s << "node " << n.offset << '\n';
                 }
             }
-
-            return start;
         }
 
-        static std::unique_ptr<Node> construct_combine_primitives(
-            const std::vector<std::tuple<T*, BoundingBox, uint64_t>>& objects,
-            size_t start,
-            size_t end
-        ) {
-            std::vector<std::unique_ptr<Node>> clusters;
+        // Updates the bounds of every node after objects have moved without changing the structure
+        // of the tree. Returns the ratio of the tree's SAH cost to its cost when it was built, so
+        // that callers can rebuild the tree once it has degraded too far.
+        template <typename TAABBFn>
+        float refit(const TAABBFn& aabb) {
+            if (this->m_nodes.empty()) return 1;
 
-            for (size_t i = start; i < end; i++) {
-                const auto& o = objects[i];
-                auto new_cluster = std::make_unique<Node>();
+            // Children always come after their parents, so walking the nodes backwards visits the
+            // tree bottom-up.
+            for (size_t i = this->m_nodes.size(); i-- > 0;) {
+                Node& n = this->m_nodes[i];
 
-                new_cluster->box = std::get<1>(o);
-                new_cluster->object = std::get<0>(o);
+                if (n.is_leaf()) {
+                    n.box = BoundingBox::empty();
 
-                clusters.push_back(std::move(new_cluster));
+                    for (uint32_t j = n.offset; j < n.offset + n.count; j++) {
+                        n.box = BoundingBox::combine(n.box, aabb(*this->m_objects[j]));
+                    }
+                } else {
+                    n.box = BoundingBox::combine(this->m_nodes[i + 1].box, this->m_nodes[n.offset].box);
+                }
             }
 
-            while (clusters.size() > 1) {
-                float best = std::numeric_limits<float>::infinity();
-                size_t i_best = 0;
-                size_t j_best = 0;
+            this->construct_wide(this->m_width, this->m_quantize);
 
-                for (size_t i = 0; i < clusters.size(); i++) {
-                    for (size_t j = i + 1; j < clusters.size(); j++) {
-                        auto& ci = clusters[i];
-                        auto& cj = clusters[j];
-                        float dist = glm::distance(ci->box.center(), cj->box.center());
+            return this->m_build_cost > 0 ? this->sah_cost() / this->m_build_cost : 1;
+        }
 
-                        if (dist < best) {
-                            best = dist;
-                            i_best = i;
-                            j_best = j;
-                        }
-                    }
+        template <typename TFn>
+        void search(const Ray& r, const TFn& fn) const {
+            this->traverse<false>(r, std::numeric_limits<float>::infinity(), this->leaf_fn([&](T& o) {
+                fn(o);
+                return false;
+            }));
+        }
+
+        // Searches for the closest object along the given ray. Children are visited nearest-first
+        // and any node which the ray enters beyond max_distance is skipped, so fn should reduce
+        // max_distance whenever it finds a closer intersection.
+        template <typename TFn>
+        void search_closest(const Ray& r, float& max_distance, const TFn& fn) const {
+            this->traverse<true>(r, max_distance, this->leaf_fn([&](T& o) {
+                fn(o);
+                return false;
+            }));
+        }
+
+        // Like search_closest, but calls fn once for each leaf with the range of indices into
+        // objects() which the leaf holds, so that all of its objects can be tested at once.
+        template <typename TFn>
+        void search_closest_leaves(const Ray& r, float& max_distance, const TFn& fn) const {
+            this->traverse<true>(r, max_distance, [&](uint32_t first, uint32_t count) {
+                fn(first, count);
+                return false;
+            });
+        }
+
+        // Searches for any objects along the given ray that the ray could hit before max_distance,
+        // in no particular order. The search stops as soon as fn returns true.
+        template <typename TFn>
+        bool search_any(const Ray& r, float max_distance, const TFn& fn) const {
+            return this->traverse<false>(r, max_distance, this->leaf_fn(fn));
+        }
+
+        // Like search_any, but calls fn once for each leaf with the range of indices into objects()
+        // which the leaf holds
+        template <typename TFn>
+        bool search_any_leaves(const Ray& r, float max_distance, const TFn& fn) const {
+            return this->traverse<false>(r, max_distance, fn);
+        }
+
+        template <typename TFn>
+        void search_closest_packet(const RayPacket& p, float* max_distances, const TFn& fn) const {
+            this->search_closest_packet_leaves(p, max_distances, [&](uint32_t first, uint32_t count, uint64_t mask) {
+                for (uint32_t j = first; j < first + count; j++) {
+                    fn(*this->m_objects[j], mask);
                 }
+            });
+        }
+
+        // Like search_closest_packet, but calls fn once for each leaf with the range of indices into
+        // objects() which the leaf holds
+        template <typename TFn>
+        void search_closest_packet_leaves(const RayPacket& p, float* max_distances, const TFn& fn) const {
+            static_assert(RayPacket::max_size <= 64, "Ray masks must fit in 64 bits");
 
-                auto new_cluster = std::make_unique<Node>();
+            struct StackEntry {
+                uint32_t node;
+                uint32_t first;
+            };
 
-                new_cluster->box = BoundingBox::combine(clusters[i_best]->box, clusters[j_best]->box);
-                new_cluster->left = std::move(clusters[i_best]);
-                new_cluster->right = std::move(clusters[j_best]);
+            if (this->m_nodes.empty() || p.size() == 0) return;
 
-                clusters.push_back(std::move(new_cluster));
+            bool coherent = p.coherent();
+            TraversalStack<StackEntry, inline_depth> stack(this->m_depth);
+            size_t stack_size = 0;
+            uint32_t i = 0;
+            size_t first = 0;
+            float distance;
 
-                clusters.erase(clusters.begin() + j_best);
-                clusters.erase(clusters.begin() + i_best);
-            }
+            while (true) {
+                const Node& n = this->m_nodes[i];
 
-            return std::move(clusters[0]);
+                if (coherent && !n.box.may_intersect(p)) {
+                    first = p.size();
+                }
+
+                // Rays before the first one that hits a node are skipped for its entire subtree, so
+                // this also culls the node if none of the rays hit it.
+                while (first < p.size() && !n.box.intersects(p[first], max_distances[first], distance)) {
+                    first++;
+                }
+
+                if (first < p.size()) {
+                    if (n.is_leaf()) {
+                        uint64_t mask = static_cast<uint64_t>(1) << first;
+
+                        for (size_t k = first + 1; k < p.size(); k++) {
+                            if (n.box.intersects(p[k], max_distances[k], distance)) {
+                                mask |= static_cast<uint64_t>(1) << k;
+                            }
+                        }
+
+                        fn(n.offset, n.count, mask);
+                    } else {
+                        // Use the first active ray to decide which child to visit first
+                        uint32_t left = i + 1;
+                        uint32_t right = n.offset;
+                        float left_distance, right_distance;
+
+                        if (!this->m_nodes[left].box.intersects(p[first], max_distances[first], left_distance)) {
+                            left_distance = std::numeric_limits<float>::infinity();
+                        }
+
+                        if (!this->m_nodes[right].box.intersects(p[first], max_distances[first], right_distance)) {
+                            right_distance = std::numeric_limits<float>::infinity();
+                        }
+
+                        if (right_distance < left_distance) {
+                            std::swap(left, right);
+                        }
+
+                        stack[stack_size++] = StackEntry { right, static_cast<uint32_t>(first) };
+                        i = left;
+                        continue;
+                    }
+                }
+
+                if (stack_size == 0) break;
+
+                i = stack[stack_size - 1].node;
+                first = stack[stack_size - 1].first;
+                stack_size--;
+            }
+        }
+    private:
+        // Turns a function called on each object into one called on the range of objects in a
+        // leaf, stopping as soon as it returns true
+        template <typename TFn>
+        auto leaf_fn(const TFn& fn) const {
+            return [this, &fn](uint32_t first, uint32_t count) {
+                for (uint32_t j = first; j < first + count; j++) {
+                    if (fn(*this->m_objects[j])) return true;
+                }
+
+                return false;
+            };
+        }
+
+        // Calls fn on the range of objects in every leaf which the ray enters before max_distance,
+        // stopping as soon as it returns true. If Ordered is set, nearer nodes are visited first
+        // and max_distance is re-read after each leaf so that fn can shorten the search.
+        template <bool Ordered, typename TFn>
+        bool traverse(const Ray& r, const float& max_distance, const TFn& fn) const {
+            if (!this->m_quantized8_nodes.empty()) {
+                return this->traverse_wide<Ordered>(this->m_quantized8_nodes, r, max_distance, fn);
+            } else if (!this->m_quantized4_nodes.empty()) {
+                return this->traverse_wide<Ordered>(this->m_quantized4_nodes, r, max_distance, fn);
+            } else if (!this->m_wide8_nodes.empty()) {
+                return this->traverse_wide<Ordered>(this->m_wide8_nodes, r, max_distance, fn);
+            } else if (!this->m_wide4_nodes.empty()) {
+                return this->traverse_wide<Ordered>(this->m_wide4_nodes, r, max_distance, fn);
+            } else {
+                return this->traverse_binary<Ordered>(r, max_distance, fn);
+            }
+        }
+
+        template <bool Ordered, typename TFn>
+        bool traverse_binary(const Ray& r, const float& max_distance, const TFn& fn) const {
+            struct StackEntry {
+                uint32_t node;
+                float distance;
+            };
+
+            float distance;
+
+            if (this->m_nodes.empty() || !this->m_nodes[0].box.intersects(r, max_distance, distance)) {
+                return false;
+            }
+
+            TraversalStack<StackEntry, inline_depth> stack(this->m_depth);
+            size_t stack_size = 0;
+            uint32_t i = 0;
+
+            while (true) {
+                const Node& n = this->m_nodes[i];
+
+                if (n.is_leaf()) {
+                    if (fn(n.offset, n.count)) return true;
+                } else {
+                    uint32_t left = i + 1;
+                    uint32_t right = n.offset;
+                    float left_distance, right_distance;
+
+                    bool hit_left = this->m_nodes[left].box.intersects(r, max_distance, left_distance);
+                    bool hit_right = this->m_nodes[right].box.intersects(r, max_distance, right_distance);
+
+                    if (hit_left && hit_right) {
+                        if (Ordered && right_distance < left_distance) {
+                            std::swap(left, right);
+                            std::swap(left_distance, right_distance);
+                        }
+
+                        stack[stack_size++] = StackEntry { right, right_distance };
+                        i = left;
+                        continue;
+                    } else if (hit_left) {
+                        i = left;
+                        continue;
+                    } else if (hit_right) {
+                        i = right;
+                        continue;
+                    }
+                }
+
+                // Skip any deferred nodes that are now known to be further away than the closest
+                // intersection found so far.
+                while (stack_size != 0 && stack[stack_size - 1].distance > max_distance) {
+                    stack_size--;
+                }
+
+                if (stack_size == 0) break;
+                i = stack[--stack_size].node;
+            }
+
+            return false;
+        }
+
+        template <bool Ordered, typename TNode, typename TFn>
+        bool traverse_wide(
+            const std::vector<TNode>& nodes,
+            const Ray& r,
+            const float& max_distance,
+            const TFn& fn
+        ) const {
+            struct StackEntry {
+                uint32_t child;
+                uint32_t count;
+                float distance;
+            };
+
+            constexpr size_t N = TNode::width;
+
+            typename TNode::TraversalRay tr(r);
+
+            // Every level of the tree can defer all but one of a node's children
+            TraversalStack<StackEntry, inline_depth * (N - 1)> stack(this->m_depth * (N - 1));
+            size_t stack_size = 0;
+            StackEntry current = StackEntry { 0, 0, 0 };
+
+            while (true) {
+                if (current.count != 0) {
+                    if (fn(current.child, current.count)) return true;
+                } else {
+                    const auto& n = nodes[current.child];
+                    float distances[N];
+                    unsigned int mask = n.intersect(tr, max_distance, distances);
+
+                    if (mask != 0) {
+                        // Push the children which were hit onto the stack, furthest first when
+                        // ordering matters, and then immediately pop the nearest one.
+                        size_t first = stack_size;
+
+                        for (size_t k = 0; k < N; k++) {
+                            if ((mask & (1u << k)) == 0) continue;
+
+                            StackEntry e = StackEntry { n.child[k], n.count[k], distances[k] };
+                            size_t pos = stack_size++;
+
+                            if (Ordered) {
+                                while (pos > first && stack[pos - 1].distance < e.distance) {
+                                    stack[pos] = stack[pos - 1];
+                                    pos--;
+                                }
+                            }
+
+                            stack[pos] = e;
+                        }
+
+                        current = stack[--stack_size];
+                        continue;
+                    }
+                }
+
+                while (stack_size != 0 && stack[stack_size - 1].distance > max_distance) {
+                    stack_size--;
+                }
+
+                if (stack_size == 0) break;
+                current = stack[--stack_size];
+            }
+
+            return false;
+        }
+    public:
+        template <typename TAABBFn>
+        static BVH<T> construct(
+            const std::vector<T*>& objects,
+            const BVHBuildOptions& options,
+            const TAABBFn& aabb
+        ) {
+            // Without any knowledge of the objects' shapes, the best that can be done when
+            // splitting one is to clip its bounding box
+            return construct(objects, options, aabb, [&](const T& o, const BoundingBox& box) {
+                return BoundingBox::intersection(aabb(o), box);
+            });
+        }
+
+        // clip should return the bounding box of the part of the given object which lies inside the
+        // given box, which is used by the sbvh builder when splitting objects.
+        template <typename TAABBFn, typename TClipFn>
+        static BVH<T> construct(
+            const std::vector<T*>& objects,
+            const BVHBuildOptions& options,
+            const TAABBFn& aabb,
+            const TClipFn& clip
+        ) {
+            if (objects.empty()) return BVH<T>();
+
+            std::unique_ptr<BuildNode> root;
+
+            switch (options.method) {
+            case BVHBuildMethod::aac:
+                root = construct_aac(objects, options.delta, aabb);
+                break;
+            case BVHBuildMethod::sah:
+                root = construct_sah(objects, aabb);
+                break;
+            case BVHBuildMethod::sbvh:
+                root = construct_sbvh(objects, options.split_budget, aabb, clip);
+                break;
+            }
+
+            BVH<T> bvh;
+
+            bvh.m_nodes.reserve(2 * objects.size() - 1);
+            bvh.m_objects.reserve(objects.size());
+            construct_choose_leaves(*root, options.max_leaf_size);
+            bvh.construct_flatten(*root, 0);
+            bvh.construct_wide(options.width, options.quantize);
+            bvh.m_build_cost = bvh.sah_cost();
+
+            return bvh;
+        }
+
+        // Rebuilds a BVH from nodes previously taken from nodes() of a tree built over the same
+        // objects, in the same order, with the same options. The nodes are checked to form a valid
+        // tree since they may have come from an untrusted file.
+        static BVH<T> from_nodes(
+            std::vector<Node> nodes,
+            std::vector<T*> objects,
+            const BVHBuildOptions& options
+        ) {
+            // Walk the tree depth-first, checking that every node comes up exactly once, in order.
+            // The left child of an interior node is implicitly the next node, so its right child
+            // must be exactly where its left subtree ends. This also rules out shared children and
+            // cycles, which would make the depth (and so the traversal stack size) come out wrong.
+            struct PendingNode {
+                size_t index;
+                size_t depth;
+            };
+
+            std::vector<PendingNode> pending;
+            size_t next = 0;
+            size_t depth = 0;
+
+            if (!nodes.empty()) pending.push_back(PendingNode { 0, 0 });
+
+            while (!pending.empty()) {
+                auto p = pending.back();
+
+                pending.pop_back();
+
+                if (p.index != next || next >= nodes.size()) {
+                    throw std::runtime_error("Invalid BVH node");
+                }
+
+                const Node& n = nodes[next++];
+
+                depth = std::max(depth, p.depth);
+
+                if (n.is_leaf()) {
+                    if (n.offset > objects.size() || n.count > objects.size() - n.offset) {
+                        throw std::runtime_error("Invalid BVH node");
+                    }
+                } else {
+                    pending.push_back(PendingNode { n.offset, p.depth + 1 });
+                    pending.push_back(PendingNode { next, p.depth + 1 });
+                }
+            }
+
+            if (next != nodes.size()) {
+                throw std::runtime_error("Invalid BVH node");
+            }
+
+            BVH<T> bvh;
+
+            bvh.m_nodes = std::move(nodes);
+            bvh.m_objects = std::move(objects);
+            bvh.m_depth = depth;
+            bvh.construct_wide(options.width, options.quantize);
+            bvh.m_build_cost = bvh.sah_cost();
+
+            return bvh;
+        }
+    private:
+        // Construction is done using approximate agglomerative clustering based off of
+        // http://graphics.cs.cmu.edu/projects/aac/aac_build.pdf
+        template <typename TAABBFn>
+        static std::unique_ptr<BuildNode> construct_aac(
+            const std::vector<T*>& objects,
+            size_t delta,
+            const TAABBFn& aabb
+        ) {
+            size_t n = objects.size();
+            size_t chunks = chunk_count(n, parallel_min_objects);
+
+            std::vector<BoundingBox> boxes(n);
+            std::vector<BoundingBox> chunk_boxes(chunks);
+
+            parallel_for_chunks(n, chunks, [&](size_t c, size_t start, size_t end) {
+                auto box = BoundingBox::empty();
+
+                for (size_t i = start; i < end; i++) {
+                    boxes[i] = aabb(*objects[i]);
+                    box = BoundingBox::combine(box, boxes[i]);
+                }
+
+                chunk_boxes[c] = box;
+            });
+
+            auto box = BoundingBox::empty();
+
+            for (const auto& b : chunk_boxes) {
+                box = BoundingBox::combine(box, b);
+            }
+
+            std::vector<MortonKey> keys;
+
+            compute_morton_keys(boxes, box, keys);
+            sort_morton_keys(keys);
+
+            // Objects and their boxes are only looked up through the sorted keys when creating the
+            // initial clusters, so there's no need to reorder them.
+            std::vector<std::unique_ptr<BuildNode>> clusters;
+
+            construct_build_tree(
+                AACInput { objects, boxes, keys },
+                0,
+                n,
+                delta,
+                62, // The top bit of the morton code we produce is always 0, so just ignore it
+                task_split_depth(),
+                clusters
+            );
+            construct_combine_clusters(clusters, 0, 1);
+
+            return std::move(clusters[0]);
+        }
+
+        struct AACInput {
+            const std::vector<T*>& objects;
+            const std::vector<BoundingBox>& boxes;
+
+            // Indices into objects and boxes, sorted by Morton code
+            const std::vector<MortonKey>& keys;
+        };
+
+        // Top-down construction which splits each node where the surface area heuristic says it will
+        // be cheapest to trace, evaluating only the boundaries between a fixed number of bins.
+        template <typename TAABBFn>
+        static std::unique_ptr<BuildNode> construct_sah(
+            const std::vector<T*>& objects,
+            const TAABBFn& aabb
+        ) {
+            std::vector<std::pair<T*, BoundingBox>> objects_boxed(objects.size());
+
+            parallel_for(objects.size(), parallel_min_objects, [&](size_t start, size_t end) {
+                for (size_t i = start; i < end; i++) {
+                    objects_boxed[i] = std::make_pair(objects[i], aabb(*objects[i]));
+                }
+            });
+
+            return construct_sah_build_tree(
+                objects_boxed,
+                0,
+                objects_boxed.size(),
+                0,
+                task_split_depth()
+            );
+        }
+
+        static std::unique_ptr<BuildNode> construct_sah_build_tree(
+            std::vector<std::pair<T*, BoundingBox>>& objects,
+            size_t start,
+            size_t end,
+            size_t depth,
+            int split_depth
+        ) {
+            auto n = std::make_unique<BuildNode>();
+
+            if (end - start == 1) {
+                n->box = objects[start].second;
+                n->object = objects[start].first;
+
+                return n;
+            }
+
+            auto centroid_box = BoundingBox::empty();
+
+            for (size_t i = start; i < end; i++) {
+                auto c = objects[i].second.center();
+
+                centroid_box = BoundingBox::combine(centroid_box, BoundingBox(c, c));
+            }
+
+            auto extent = centroid_box.size();
+            int axis = 0;
+
+            if (extent.y > extent[axis]) axis = 1;
+            if (extent.z > extent[axis]) axis = 2;
+
+            size_t part = start;
+
+            // Past a certain depth, fall back to median splits so that the tree can't exceed the
+            // maximum depth even if the SAH keeps choosing very unbalanced splits.
+            if (extent[axis] > 0 && depth < inline_depth / 2) {
+                part = construct_sah_make_partition(objects, start, end, axis, centroid_box);
+            }
+
+            if (part == start || part == end) {
+                part = construct_median_partition(objects, start, end, axis);
+            }
+
+            if (split_depth > 0 && end - start >= parallel_min_objects) {
+                auto left = std::async(std::launch::async, [&]() {
+                    return construct_sah_build_tree(objects, start, part, depth + 1, split_depth - 1);
+                });
+
+                n->right = construct_sah_build_tree(objects, part, end, depth + 1, split_depth - 1);
+                n->left = left.get();
+            } else {
+                n->left = construct_sah_build_tree(objects, start, part, depth + 1, 0);
+                n->right = construct_sah_build_tree(objects, part, end, depth + 1, 0);
+            }
+            n->box = BoundingBox::combine(n->left->box, n->right->box);
+
+            return n;
+        }
+
+        static size_t construct_median_partition(
+            std::vector<std::pair<T*, BoundingBox>>& objects,
+            size_t start,
+            size_t end,
+            int axis
+        ) {
+            size_t part = start + (end - start) / 2;
+
+            std::nth_element(
+                objects.begin() + start,
+                objects.begin() + part,
+                objects.begin() + end,
+                [axis](const auto& a, const auto& b) {
+                    return a.second.center()[axis] < b.second.center()[axis];
+                }
+            );
+
+            return part;
+        }
+
+        // Partitions the objects along the given axis at the cheapest split according to the SAH,
+        // storing the cost of the split in cost if given. Returns start if no split is possible.
+        static size_t construct_sah_make_partition(
+            std::vector<std::pair<T*, BoundingBox>>& objects,
+            size_t start,
+            size_t end,
+            int axis,
+            const BoundingBox& centroid_box,
+            float* cost = nullptr
+        ) {
+            constexpr size_t num_bins = 16;
+
+            struct Bin {
+                BoundingBox box = BoundingBox::empty();
+                size_t count = 0;
+            };
+
+            Bin bins[num_bins];
+            float bin_min = centroid_box.min()[axis];
+            float bin_scale = num_bins / (centroid_box.max()[axis] - bin_min);
+
+            auto get_bin = [&](const BoundingBox& b) {
+                return std::min(
+                    static_cast<size_t>((b.center()[axis] - bin_min) * bin_scale),
+                    num_bins - 1
+                );
+            };
+
+            for (size_t i = start; i < end; i++) {
+                auto& bin = bins[get_bin(objects[i].second)];
+
+                bin.box = BoundingBox::combine(bin.box, objects[i].second);
+                bin.count++;
+            }
+
+            // Sweep from the right first so that the cost of every split can then be found in a
+            // single sweep from the left.
+            float right_area[num_bins];
+            size_t right_count[num_bins];
+
+            {
+                auto box = BoundingBox::empty();
+                size_t count = 0;
+
+                for (size_t i = num_bins - 1; i > 0; i--) {
+                    box = BoundingBox::combine(box, bins[i].box);
+                    count += bins[i].count;
+
+                    right_area[i] = count ? box.surface_area() : 0;
+                    right_count[i] = count;
+                }
+            }
+
+            float best_cost = std::numeric_limits<float>::infinity();
+            size_t best_split = 0;
+
+            {
+                auto box = BoundingBox::empty();
+                size_t count = 0;
+
+                for (size_t i = 1; i < num_bins; i++) {
+                    box = BoundingBox::combine(box, bins[i - 1].box);
+                    count += bins[i - 1].count;
+
+                    if (count == 0 || right_count[i] == 0) continue;
+
+                    float cost = box.surface_area() * count + right_area[i] * right_count[i];
+
+                    if (cost < best_cost) {
+                        best_cost = cost;
+                        best_split = i;
+                    }
+                }
+            }
+
+            if (best_split == 0) return start;
+            if (cost) *cost = best_cost;
+
+            return std::partition(
+                objects.begin() + start,
+                objects.begin() + end,
+                [&](const auto& o) { return get_bin(o.second) < best_split; }
+            ) - objects.begin();
+        }
+
+        // Builds a split BVH based off of https://www.nvidia.com/docs/IO/77714/sbvh.pdf. At each
+        // node, the cheapest object split is compared to the cheapest spatial split, which divides
+        // space at a plane and sends any object crossing it to both sides, clipped to each side.
+        // Large objects next to small ones then no longer force their siblings' boxes to overlap.
+        template <typename TAABBFn, typename TClipFn>
+        static std::unique_ptr<BuildNode> construct_sbvh(
+            const std::vector<T*>& objects,
+            float split_budget,
+            const TAABBFn& aabb,
+            const TClipFn& clip
+        ) {
+            std::vector<std::pair<T*, BoundingBox>> refs(objects.size());
+            auto box = BoundingBox::empty();
+
+            for (size_t i = 0; i < objects.size(); i++) {
+                refs[i] = std::make_pair(objects[i], aabb(*objects[i]));
+                box = BoundingBox::combine(box, refs[i].second);
+            }
+
+            size_t budget = static_cast<size_t>(std::max(0.0f, split_budget) * objects.size());
+
+            return construct_sbvh_build_tree(std::move(refs), box.surface_area(), 0, budget, clip);
+        }
+
+        template <typename TClipFn>
+        static std::unique_ptr<BuildNode> construct_sbvh_build_tree(
+            std::vector<std::pair<T*, BoundingBox>> refs,
+            float root_area,
+            size_t depth,
+            size_t& budget,
+            const TClipFn& clip
+        ) {
+            // Spatial splits are only attempted where the children of the best object split
+            // overlap by at least this fraction of the root's surface area, since elsewhere they
+            // rarely help and just use up the budget.
+            constexpr float min_overlap = 1e-5f;
+
+            auto n = std::make_unique<BuildNode>();
+
+            if (refs.size() == 1) {
+                n->box = refs[0].second;
+                n->object = refs[0].first;
+
+                return n;
+            }
+
+            auto box = BoundingBox::empty();
+            auto centroid_box = BoundingBox::empty();
+
+            for (const auto& r : refs) {
+                auto c = r.second.center();
+
+                box = BoundingBox::combine(box, r.second);
+                centroid_box = BoundingBox::combine(centroid_box, BoundingBox(c, c));
+            }
+
+            auto extent = centroid_box.size();
+            int axis = 0;
+
+            if (extent.y > extent[axis]) axis = 1;
+            if (extent.z > extent[axis]) axis = 2;
+
+            size_t part = 0;
+            float object_cost = std::numeric_limits<float>::infinity();
+
+            if (extent[axis] > 0 && depth < inline_depth / 2) {
+                part = construct_sah_make_partition(refs, 0, refs.size(), axis, centroid_box, &object_cost);
+            }
+
+            std::vector<std::pair<T*, BoundingBox>> left;
+            std::vector<std::pair<T*, BoundingBox>> right;
+
+            if (depth < inline_depth / 2 && budget > 0) {
+                auto overlap = BoundingBox::empty();
+
+                if (part != 0 && part != refs.size()) {
+                    auto left_box = BoundingBox::empty();
+                    auto right_box = BoundingBox::empty();
+
+                    for (size_t i = 0; i < refs.size(); i++) {
+                        auto& b = i < part ? left_box : right_box;
+
+                        b = BoundingBox::combine(b, refs[i].second);
+                    }
+
+                    overlap = BoundingBox::intersection(left_box, right_box);
+                }
+
+                // If there's no usable object split, a spatial split is the only option
+                if (
+                    object_cost == std::numeric_limits<float>::infinity()
+                    || (!overlap.is_empty() && overlap.surface_area() > min_overlap * root_area)
+                ) {
+                    construct_sbvh_spatial_split(refs, box, object_cost, budget, clip, left, right);
+                }
+            }
+
+            if (left.empty() || right.empty()) {
+                if (part == 0 || part == refs.size()) {
+                    part = construct_median_partition(refs, 0, refs.size(), axis);
+                }
+
+                left.assign(refs.begin(), refs.begin() + part);
+                right.assign(refs.begin() + part, refs.end());
+            }
+
+            refs.clear();
+            refs.shrink_to_fit();
+
+            n->left = construct_sbvh_build_tree(std::move(left), root_area, depth + 1, budget, clip);
+            n->right = construct_sbvh_build_tree(std::move(right), root_area, depth + 1, budget, clip);
+            n->box = BoundingBox::combine(n->left->box, n->right->box);
+
+            return n;
+        }
+
+        // Finds the cheapest spatial split along the longest axis of box and, if it's cheaper than
+        // max_cost and doesn't need more extra references than remain in the budget, divides the
+        // references between left and right accordingly.
+        template <typename TClipFn>
+        static void construct_sbvh_spatial_split(
+            const std::vector<std::pair<T*, BoundingBox>>& refs,
+            const BoundingBox& box,
+            float max_cost,
+            size_t& budget,
+            const TClipFn& clip,
+            std::vector<std::pair<T*, BoundingBox>>& left,
+            std::vector<std::pair<T*, BoundingBox>>& right
+        ) {
+            constexpr size_t num_bins = 16;
+
+            struct Bin {
+                BoundingBox box = BoundingBox::empty();
+
+                // The number of references which start and end in this bin respectively
+                size_t entries = 0;
+                size_t exits = 0;
+            };
+
+            auto extent = box.size();
+            int axis = 0;
+
+            if (extent.y > extent[axis]) axis = 1;
+            if (extent.z > extent[axis]) axis = 2;
+
+            if (extent[axis] <= 0) return;
+
+            Bin bins[num_bins];
+            float bin_min = box.min()[axis];
+            float bin_width = extent[axis] / num_bins;
+
+            auto get_bin = [&](float v) {
+                return std::min(
+                    static_cast<size_t>(std::max(0.0f, (v - bin_min) / bin_width)),
+                    num_bins - 1
+                );
+            };
+
+            // The part of the given box between the planes at the start of the given bins
+            auto slab = [&](const BoundingBox& b, size_t first, size_t last) {
+                auto min = b.min();
+                auto max = b.max();
+
+                if (first > 0) min[axis] = std::max(min[axis], bin_min + first * bin_width);
+                if (last < num_bins) max[axis] = std::min(max[axis], bin_min + last * bin_width);
+
+                return BoundingBox(min, max);
+            };
+
+            for (const auto& r : refs) {
+                size_t first = get_bin(r.second.min()[axis]);
+                size_t last = get_bin(r.second.max()[axis]);
+
+                if (first == last) {
+                    bins[first].box = BoundingBox::combine(bins[first].box, r.second);
+                } else {
+                    for (size_t i = first; i <= last; i++) {
+                        auto b = clip(*r.first, slab(r.second, i, i + 1));
+
+                        if (!b.is_empty()) bins[i].box = BoundingBox::combine(bins[i].box, b);
+                    }
+                }
+
+                bins[first].entries++;
+                bins[last].exits++;
+            }
+
+            float right_area[num_bins];
+            size_t right_count[num_bins];
+
+            {
+                auto b = BoundingBox::empty();
+                size_t count = 0;
+
+                for (size_t i = num_bins - 1; i > 0; i--) {
+                    b = BoundingBox::combine(b, bins[i].box);
+                    count += bins[i].exits;
+
+                    right_area[i] = count ? b.surface_area() : 0;
+                    right_count[i] = count;
+                }
+            }
+
+            float best_cost = max_cost;
+            size_t best_split = 0;
+
+            {
+                auto b = BoundingBox::empty();
+                size_t count = 0;
+
+                for (size_t i = 1; i < num_bins; i++) {
+                    b = BoundingBox::combine(b, bins[i - 1].box);
+                    count += bins[i - 1].entries;
+
+                    if (count == 0 || right_count[i] == 0) continue;
+                    if (count + right_count[i] - refs.size() > budget) continue;
+
+                    float cost = b.surface_area() * count + right_area[i] * right_count[i];
+
+                    if (cost < best_cost) {
+                        best_cost = cost;
+                        best_split = i;
+                    }
+                }
+            }
+
+            if (best_split == 0) return;
+
+            for (const auto& r : refs) {
+                size_t first = get_bin(r.second.min()[axis]);
+                size_t last = get_bin(r.second.max()[axis]);
+
+                if (last < best_split) {
+                    left.push_back(r);
+                } else if (first >= best_split) {
+                    right.push_back(r);
+                } else {
+                    auto left_box = clip(*r.first, slab(r.second, 0, best_split));
+                    auto right_box = clip(*r.first, slab(r.second, best_split, num_bins));
+
+                    if (!left_box.is_empty()) left.push_back(std::make_pair(r.first, left_box));
+                    if (!right_box.is_empty()) right.push_back(std::make_pair(r.first, right_box));
+                }
+            }
+
+            // Clipping can occasionally leave one side empty, in which case the split is useless
+            if (left.empty() || right.empty()) {
+                left.clear();
+                right.clear();
+            } else if (left.size() + right.size() > refs.size()) {
+                budget -= std::min(budget, left.size() + right.size() - refs.size());
+            }
+        }
+
+        void construct_wide(size_t width, bool quantize) {
+            this->m_width = width;
+            this->m_quantize = quantize;
+            this->m_wide4_nodes.clear();
+            this->m_wide8_nodes.clear();
+            this->m_quantized4_nodes.clear();
+            this->m_quantized8_nodes.clear();
+
+            // A tree consisting of only a single leaf can't be collapsed any further
+            if (this->m_nodes.size() < 2) return;
+
+            if (width == 4) {
+                construct_collapse(this->m_nodes, this->m_wide4_nodes, 0);
+
+                if (quantize) construct_quantize(this->m_wide4_nodes, this->m_quantized4_nodes);
+            } else if (width == 8) {
+                construct_collapse(this->m_nodes, this->m_wide8_nodes, 0);
+
+                if (quantize) construct_quantize(this->m_wide8_nodes, this->m_quantized8_nodes);
+            }
+        }
+
+        template <size_t N>
+        static void construct_quantize(
+            std::vector<WideBVHNode<N>>& wide_nodes,
+            std::vector<QuantizedWideBVHNode<N>>& quantized_nodes
+        ) {
+            quantized_nodes.reserve(wide_nodes.size());
+
+            for (const auto& n : wide_nodes) {
+                quantized_nodes.emplace_back(n);
+            }
+
+            // Only the quantized nodes are needed for traversal
+            std::vector<WideBVHNode<N>>().swap(wide_nodes);
+        }
+
+        // Builds a wide node from the given interior node of the binary tree by repeatedly
+        // replacing the child with the largest surface area by its own children until the wide node
+        // is full, returning the index of the new node.
+        template <size_t N>
+        static uint32_t construct_collapse(
+            const std::vector<Node>& nodes,
+            std::vector<WideBVHNode<N>>& wide_nodes,
+            uint32_t i
+        ) {
+            uint32_t children[N] = { i + 1, nodes[i].offset };
+            size_t num_children = 2;
+
+            while (num_children < N) {
+                float best_area = -1;
+                size_t best = N;
+
+                for (size_t k = 0; k < num_children; k++) {
+                    const Node& c = nodes[children[k]];
+
+                    if (!c.is_leaf() && c.box.surface_area() > best_area) {
+                        best_area = c.box.surface_area();
+                        best = k;
+                    }
+                }
+
+                if (best == N) break;
+
+                uint32_t opened = children[best];
+
+                children[best] = opened + 1;
+                children[num_children++] = nodes[opened].offset;
+            }
+
+            uint32_t wi = static_cast<uint32_t>(wide_nodes.size());
+
+            wide_nodes.emplace_back();
+
+            for (size_t k = 0; k < N; k++) {
+                wide_nodes[wi].set_empty(k);
+            }
+
+            for (size_t k = 0; k < num_children; k++) {
+                const Node& c = nodes[children[k]];
+
+                if (c.is_leaf()) {
+                    wide_nodes[wi].set_child(k, c.box, c.offset, c.count);
+                } else {
+                    uint32_t child = construct_collapse(nodes, wide_nodes, children[k]);
+
+                    wide_nodes[wi].set_child(k, c.box, child, 0);
+                }
+            }
+
+            return wi;
+        }
+
+        // Decides which subtrees should be collapsed into a single leaf by comparing the SAH cost of
+        // intersecting all of their objects directly to the cost of keeping them split.
+        static void construct_choose_leaves(BuildNode& n, size_t max_leaf_size) {
+            float area = n.box.surface_area();
+
+            if (n.object) {
+                n.count = 1;
+                n.cost = area * intersection_cost;
+                n.make_leaf = true;
+
+                return;
+            }
+
+            construct_choose_leaves(*n.left, max_leaf_size);
+            construct_choose_leaves(*n.right, max_leaf_size);
+
+            n.count = n.left->count + n.right->count;
+
+            float split_cost = area * traversal_cost + n.left->cost + n.right->cost;
+            float leaf_cost = area * n.count * intersection_cost;
+
+            n.make_leaf = n.count <= max_leaf_size && leaf_cost <= split_cost;
+            n.cost = n.make_leaf ? leaf_cost : split_cost;
+        }
+
+        void construct_flatten(const BuildNode& n, size_t depth) {
+            this->m_depth = std::max(this->m_depth, depth);
+
+            size_t i = this->m_nodes.size();
+
+            this->m_nodes.push_back(Node { n.box, 0, 0 });
+
+            if (n.make_leaf) {
+                this->m_nodes[i].offset = static_cast<uint32_t>(this->m_objects.size());
+                this->m_nodes[i].count = static_cast<uint32_t>(n.count);
+                this->construct_flatten_leaf(n);
+            } else {
+                this->construct_flatten(*n.left, depth + 1);
+                this->m_nodes[i].offset = static_cast<uint32_t>(this->m_nodes.size());
+                this->construct_flatten(*n.right, depth + 1);
+            }
+        }
+
+        void construct_flatten_leaf(const BuildNode& n) {
+            if (n.object) {
+                this->m_objects.push_back(n.object);
+            } else {
+                this->construct_flatten_leaf(*n.left);
+                this->construct_flatten_leaf(*n.right);
+            }
+        }
+
+        // The number of clusters that a subtree built from n objects is reduced to before being
+        // passed up to its parent, i.e. f(n) from the AAC paper.
+        static size_t construct_reduction(size_t delta, size_t n) {
+            // The paper's "HQ" configuration, which favours tree quality over build speed
+            constexpr float epsilon = 0.1f;
+
+            float c = std::pow(static_cast<float>(delta), 0.5f + epsilon) / 2;
+
+            return std::max<size_t>(1, c * std::pow(static_cast<float>(n), 0.5f - epsilon));
+        }
+
+        static void construct_build_tree(
+            const AACInput& input,
+            size_t start,
+            size_t end,
+            size_t delta,
+            int bit,
+            int split_depth,
+            std::vector<std::unique_ptr<BuildNode>>& clusters
+        ) {
+            if ((end - start) <= delta) {
+                size_t first = clusters.size();
+
+                for (size_t i = start; i < end; i++) {
+                    const auto& k = input.keys[i];
+                    auto new_cluster = std::make_unique<BuildNode>();
+
+                    new_cluster->box = input.boxes[k.index];
+                    new_cluster->object = input.objects[k.index];
+
+                    clusters.push_back(std::move(new_cluster));
+                }
+
+                construct_combine_clusters(clusters, first, construct_reduction(delta, delta));
+                return;
+            }
+
+            size_t part;
+
+            if (bit < 0) {
+                // We've run out of Morton code bits to split on, so the remaining objects all have
+                // (nearly) the same center and any split is as good as any other.
+                part = start + (end - start) / 2;
+            } else {
+                part = construct_make_partition(input.keys, start, end, bit);
+
+                if (part == start || part == end) {
+                    construct_build_tree(input, start, end, delta, bit - 1, split_depth, clusters);
+                    return;
+                }
+            }
+
+            size_t first = clusters.size();
+
+            if (split_depth > 0 && end - start >= parallel_min_objects) {
+                // Build the left half on another thread into a separate list of clusters, so that
+                // the clusters still end up in the same order as when building serially.
+                std::vector<std::unique_ptr<BuildNode>> left_clusters;
+                std::vector<std::unique_ptr<BuildNode>> right_clusters;
+
+                auto left = std::async(std::launch::async, [&]() {
+                    construct_build_tree(
+                        input,
+                        start,
+                        part,
+                        delta,
+                        bit - 1,
+                        split_depth - 1,
+                        left_clusters
+                    );
+                });
+
+                construct_build_tree(
+                    input,
+                    part,
+                    end,
+                    delta,
+                    bit - 1,
+                    split_depth - 1,
+                    right_clusters
+                );
+                left.get();
+
+                std::move(left_clusters.begin(), left_clusters.end(), std::back_inserter(clusters));
+                std::move(right_clusters.begin(), right_clusters.end(), std::back_inserter(clusters));
+            } else {
+                construct_build_tree(input, start, part, delta, bit - 1, 0, clusters);
+                construct_build_tree(input, part, end, delta, bit - 1, 0, clusters);
+            }
+            construct_combine_clusters(clusters, first, construct_reduction(delta, end - start));
+        }
+
+        // Finds the first key in [start, end) which has the given bit of its Morton code set. Since
+        // keys are sorted by Morton code and all keys in the range share the bits above this one,
+        // this is the point at which the range should be split.
+        static size_t construct_make_partition(
+            const std::vector<MortonKey>& keys,
+            size_t start,
+            size_t end,
+            int bit
+        ) {
+            uint64_t bitmask = static_cast<uint64_t>(1) << bit;
+
+            while (start < end) {
+                size_t mid = start + (end - start) / 2;
+
+                if ((keys[mid].code & bitmask) == 0) {
+                    start = mid + 1;
+                } else {
+                    end = mid;
+                }
+            }
+
+            return start;
+        }
+
+        // Greedily merges the clusters from index first onwards until only max_clusters of them
+        // remain, always merging the pair whose combined bounding box has the smallest surface
+        // area.
+        static void construct_combine_clusters(
+            std::vector<std::unique_ptr<BuildNode>>& all_clusters,
+            size_t first,
+            size_t max_clusters
+        ) {
+            auto clusters = all_clusters.begin() + first;
+            size_t size = all_clusters.size() - first;
+
+            if (size <= max_clusters) return;
+
+            // Cache the dissimilarity between every pair of clusters, along with the index of the
+            // closest cluster to each one, so that each merge only has to update the entries that
+            // involve the merged clusters.
+            const size_t stride = size;
+            std::vector<float> dist(size * size);
+            std::vector<size_t> closest(size);
+
+            auto d = [&](size_t i, size_t j) -> float& { return dist[i * stride + j]; };
+
+            // Start from an actual candidate rather than an infinite distance, since surface areas
+            // can overflow to infinity for huge boxes and a cluster must never pair with itself
+            auto find_closest = [&](size_t i) {
+                if (size < 2) return i;
+
+                size_t j_best = i == 0 ? 1 : 0;
+                float best = d(i, j_best);
+
+                for (size_t j = 0; j < size; j++) {
+                    if (j != i && d(i, j) < best) {
+                        best = d(i, j);
+                        j_best = j;
+                    }
+                }
+
+                return j_best;
+            };
+
+            for (size_t i = 0; i < size; i++) {
+                for (size_t j = 0; j < i; j++) {
+                    d(i, j) = d(j, i) = BoundingBox::combine(
+                        clusters[i]->box,
+                        clusters[j]->box
+                    ).surface_area();
+                }
+            }
+
+            for (size_t i = 0; i < size; i++) {
+                closest[i] = find_closest(i);
+            }
+
+            while (size > max_clusters) {
+                size_t left = 0;
+                size_t right = closest[0];
+                float best = d(left, right);
+
+                for (size_t i = 1; i < size; i++) {
+                    if (d(i, closest[i]) < best) {
+                        best = d(i, closest[i]);
+                        left = i;
+                        right = closest[i];
+                    }
+                }
+
+                if (right < left) std::swap(left, right);
+
+                auto new_cluster = std::make_unique<BuildNode>();
+
+                new_cluster->box = BoundingBox::combine(clusters[left]->box, clusters[right]->box);
+                new_cluster->left = std::move(clusters[left]);
+                new_cluster->right = std::move(clusters[right]);
+
+                clusters[left] = std::move(new_cluster);
+
+                // Fill the hole left by the right cluster with the last cluster
+                size_t last = --size;
+
+                if (right != last) {
+                    clusters[right] = std::move(clusters[last]);
+                    closest[right] = closest[last];
+
+                    for (size_t k = 0; k < size; k++) {
+                        d(right, k) = d(k, right) = d(last, k);
+                    }
+                }
+
+                all_clusters.pop_back();
+
+                for (size_t k = 0; k < size; k++) {
+                    if (k != left) {
+                        d(left, k) = d(k, left) = BoundingBox::combine(
+                            clusters[left]->box,
+                            clusters[k]->box
+                        ).surface_area();
+                    }
+                }
+
+                for (size_t k = 0; k < size; k++) {
+                    if (k == left || closest[k] == left || closest[k] == right) {
+                        closest[k] = find_closest(k);
+                    } else if (closest[k] == last) {
+                        closest[k] = right;
+                    }
+                }
+            }
         }
     };
 }
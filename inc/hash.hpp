@@ -0,0 +1,34 @@
+#ifndef HW4_HASH_HPP
+#define HW4_HASH_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+namespace hw4 {
+    // 64-bit FNV-1a
+    class Hasher {
+        uint64_t m_hash = 0xcbf29ce484222325;
+    public:
+        Hasher& add(const void* data, size_t size) {
+            auto bytes = static_cast<const unsigned char*>(data);
+
+            for (size_t i = 0; i < size; i++) {
+                this->m_hash = (this->m_hash ^ bytes[i]) * 0x100000001b3;
+            }
+
+            return *this;
+        }
+
+        template <typename T>
+        Hasher& add(const T& value) {
+            static_assert(std::is_arithmetic<T>::value, "Only plain numbers can be hashed");
+
+            return this->add(&value, sizeof(value));
+        }
+
+        uint64_t hash() const { return this->m_hash; }
+    };
+}
+
+#endif
@@ -32,6 +32,8 @@ namespace hw4 {
         float m_transmittance = 0;
         float m_refractive_index = 1;
     public:
+        float opacity() const { return this->m_opacity; }
+
         PointMaterial at_point(glm::vec2 texcoord) const {
             auto m = PointMaterial {
                 .ambient = this->m_ambient,
@@ -0,0 +1,60 @@
+#ifndef HW4_MESH_CACHE_HPP
+#define HW4_MESH_CACHE_HPP
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+#include <boost/filesystem.hpp>
+
+#include "bvh.hpp"
+#include "object.hpp"
+
+namespace hw4 {
+    // A directory of preprocessed meshes, each stored with its BVH in a binary format that can be
+    // read back without any parsing. Entries are keyed by a hash of the contents of the OBJ file
+    // along with the options used to build the BVH, so stale entries are never used.
+    class MeshCache {
+        boost::filesystem::path m_dir;
+        BVHBuildOptions m_options;
+
+        typedef std::pair<boost::filesystem::path, uint64_t> PendingEntry;
+
+        // Meshes which load_mesh didn't find in the cache, along with where their entries go once
+        // their BVHs have been built. These are weak references since a scene which fails to load
+        // never builds its meshes, and comparing owners means a mesh allocated later in the same
+        // place can't be mistaken for one of these.
+        mutable std::mutex m_mutex;
+        mutable std::map<
+            std::weak_ptr<TriMesh>,
+            PendingEntry,
+            std::owner_less<std::weak_ptr<TriMesh>>
+        > m_misses;
+
+        boost::filesystem::path entry_path(uint64_t key) const;
+        std::shared_ptr<TriMesh> read_entry(const boost::filesystem::path& path, uint64_t key) const;
+        void write_entry(const boost::filesystem::path& path, uint64_t key, const TriMesh& mesh) const;
+    public:
+        MeshCache(boost::filesystem::path dir, const BVHBuildOptions& options)
+            : m_dir(std::move(dir)), m_options(options) {}
+        MeshCache(const MeshCache& other) = delete;
+
+        MeshCache& operator =(const MeshCache& other) = delete;
+
+        const boost::filesystem::path& dir() const { return this->m_dir; }
+        const BVHBuildOptions& options() const { return this->m_options; }
+
+        // Loads the mesh in the given OBJ file along with its BVH, from the cache if possible.
+        // Otherwise, the mesh is loaded as normal but doesn't have a BVH until it's passed to
+        // build_bvh. Building is left to the caller since a single build already uses every core,
+        // while meshes are loaded in parallel.
+        std::shared_ptr<TriMesh> load_mesh(const boost::filesystem::path& path) const;
+
+        // Builds the BVH of a mesh which load_mesh didn't find in the cache and adds the result to
+        // the cache. Meshes which came from the cache already have their BVHs and are left alone.
+        void build_bvh(const std::shared_ptr<TriMesh>& mesh) const;
+    };
+}
+
+#endif
@@ -2,6 +2,7 @@
 #define HW4_OBJECT_HPP
 
 #include <array>
+#include <cmath>
 #include <memory>
 
 #include <boost/filesystem.hpp>
@@ -47,27 +48,86 @@ namespace hw4 {
             return *this;
         }
 
-        Intersection transform(const glm::mat4& transform, float dist_mult) const {
+        // Returns the same intersection moved to a different point and normal, with its distance
+        // scaled by dist_mult
+        Intersection relocate(glm::vec3 point, glm::vec3 normal, float dist_mult) const {
             return Intersection(
+                point,
+                normal,
+                this->m_texcoord,
+                this->m_material,
+                this->m_distance * dist_mult
+            );
+        }
+
+        Intersection transform(const glm::mat4& transform, float dist_mult) const {
+            return this->relocate(
                 glm::vec3(transform * glm::vec4(this->m_point, 1)),
                 // Since we only allow orthogonal transformations and translations, we can just use
                 // the transform directly.
                 glm::normalize(glm::mat3(transform) * this->m_normal),
-                this->m_texcoord,
-                this->m_material,
-                this->m_distance * dist_mult
+                dist_mult
             );
         }
     };
 
+    // A lightweight record of where a ray hits an object, holding just enough to build the full
+    // Intersection later. Building that involves interpolating normals and texture coordinates,
+    // which is only worth doing once the hit is known to be the closest one.
+    struct Hit {
+        // The distance along the ray which was tested, which is in object space unless the hit was
+        // found in world space
+        float t;
+
+        // Converts t into a world-space distance
+        float dist_mult;
+
+        // Identifies which part of the object was hit, such as the index of a triangle, along with
+        // the barycentric coordinates of the hit if it has any
+        uint32_t primitive;
+        float u;
+        float v;
+
+        float distance() const { return this->t * this->dist_mult; }
+    };
+
+    // The kinds of transform which objects can have, from most to least specialized. Moving rays
+    // in and out of object space is much cheaper for the simpler kinds, and nearly all objects in
+    // practice are just translated and uniformly scaled.
+    enum class TransformClass {
+        identity,      // x
+        translation,   // x + t
+        uniform_scale, // s * x + t
+        similarity,    // s * R * x + t, where R is a rotation (or reflection)
+        general
+    };
+
+    // The concrete types of objects, so that code which handles many objects can sort them by type
+    // and dispatch to each without virtual calls
+    enum class ObjectKind {
+        sphere,
+        mesh,
+        other
+    };
+
     class Object {
         glm::mat4 m_transform;
         glm::mat4 m_inv_transform;
 
+        // For anything up to a similarity, the transform is decomposed into its parts
+        TransformClass m_transform_class;
+        glm::vec3 m_translation;
+        float m_scale;
+        float m_inv_scale;
+        glm::mat3 m_rotation;
+        glm::mat3 m_inv_rotation;
+
         BoundingBox m_obb;
         BoundingBox m_aabb;
 
         std::shared_ptr<Material> m_material;
+
+        void classify_transform();
     public:
         Object(
             BoundingBox obb,
@@ -75,7 +135,9 @@ namespace hw4 {
             const std::shared_ptr<Material>& material
         )
             : m_transform(transform), m_inv_transform(glm::inverse(transform)), m_obb(obb),
-              m_aabb(transform * obb), m_material(material) {}
+              m_aabb(transform * obb), m_material(material) {
+            this->classify_transform();
+        }
         virtual ~Object() = default;
 
         const glm::mat4& transform() const { return this->m_transform; }
@@ -83,21 +145,112 @@ namespace hw4 {
             this->m_transform = transform;
             this->m_inv_transform = glm::inverse(this->m_transform);
             this->m_aabb = transform * this->m_obb;
+            this->classify_transform();
 
             return *this;
         }
 
         const glm::mat4& inv_transform() const { return this->m_inv_transform; }
 
+        TransformClass transform_class() const { return this->m_transform_class; }
+
+        // Only meaningful when the transform is at most a similarity
+        const glm::vec3& translation() const { return this->m_translation; }
+        float scale() const { return this->m_scale; }
+        const glm::mat3& rotation() const { return this->m_rotation; }
+
+        // Transforms the given world-space ray into object space. Distances along the object-space
+        // ray must be multiplied by dist_mult to get distances along the world-space ray.
+        Ray to_object_space(const Ray& r, float& dist_mult) const;
+
+        // Transforms the given intersection, found with a ray returned by to_object_space, back
+        // into world space
+        Intersection to_world_space(const Intersection& i, float dist_mult) const;
+
         const BoundingBox& obb() const { return this->m_obb; }
         const BoundingBox& aabb() const { return this->m_aabb; }
 
         const std::shared_ptr<Material>& material() const { return this->m_material; }
 
-        virtual boost::optional<Intersection> find_intersection(const Ray& r) const = 0;
+        virtual ObjectKind kind() const { return ObjectKind::other; }
+
+        // Finds the closest hit of the given object-space ray on this object, ignoring any hits
+        // further away than max_distance.
+        virtual boost::optional<Hit> find_hit(const Ray& r, float max_distance) const = 0;
+
+        // Finds the closest hit of each ray in the given object-space packet on this object,
+        // ignoring any hits further away than that ray's entry in max_distances. The entries of
+        // max_distances are reduced to the distance of any hit found.
+        virtual void find_hits(
+            const RayPacket& p,
+            float* max_distances,
+            boost::optional<Hit>* hits
+        ) const;
+
+        // Builds the full intersection for a hit which find_hit found with the given object-space
+        // ray. The normal must have unit length, since most transforms don't renormalize it.
+        virtual Intersection intersection(const Ray& r, const Hit& hit) const = 0;
+
+        // Checks whether the given object-space ray hits this object anywhere before max_distance.
+        virtual bool occludes(const Ray& r, float max_distance) const = 0;
+
+        // Like find_hit, intersection and occludes, but for world-space rays and distances. By
+        // default, these move the ray into object space and back, but objects may override them
+        // to work in world space directly.
+        virtual boost::optional<Hit> find_world_hit(const Ray& r, float max_distance) const;
+        virtual Intersection world_intersection(const Ray& r, const Hit& hit) const;
+        virtual bool world_occludes(const Ray& r, float max_distance) const;
+
+        // The default implementations of find_world_hit and world_occludes, which use fn in place
+        // of find_hit or occludes. Callers which know the concrete type of the object can use these
+        // to avoid virtual calls.
+        template <typename TFn>
+        boost::optional<Hit> find_world_hit_using(const Ray& r, float max_distance, const TFn& fn) const {
+            float dist_mult;
+            Ray obj_ray = this->to_object_space(r, dist_mult);
+            boost::optional<Hit> hit = fn(obj_ray, max_distance / dist_mult);
+
+            if (hit) {
+                hit->dist_mult = dist_mult;
+            }
+
+            return hit;
+        }
+
+        template <typename TFn>
+        bool world_occludes_using(const Ray& r, float max_distance, const TFn& fn) const {
+            float dist_mult;
+            Ray obj_ray = this->to_object_space(r, dist_mult);
+
+            return fn(obj_ray, max_distance / dist_mult);
+        }
     };
 
-    class SphereObject : public Object {
+    // Finds the closest positive distance at which the given ray hits the sphere with the given
+    // center and radius
+    inline bool intersect_sphere(const Ray& r, glm::vec3 center, float radius, float& t) {
+        auto origin = r.origin() - center;
+
+        float b = glm::dot(2.0f * r.direction(), origin);
+        float c = glm::dot(origin, origin) - radius * radius;
+
+        float qterm = b * b - 4 * c;
+
+        if (qterm < 0)
+            return false;
+
+        t = -(b + std::sqrt(qterm)) / 2;
+
+        if (t <= 0) {
+            t = -(b - std::sqrt(qterm)) / 2;
+
+            if (t <= 0) return false;
+        }
+
+        return true;
+    }
+
+    class SphereObject final : public Object {
     public:
         SphereObject(
             float radius,
@@ -105,7 +258,20 @@ namespace hw4 {
             const std::shared_ptr<Material>& material
         );
 
-        virtual boost::optional<Intersection> find_intersection(const Ray& r) const;
+        virtual boost::optional<Hit> find_hit(const Ray& r, float max_distance) const;
+        virtual Intersection intersection(const Ray& r, const Hit& hit) const;
+        virtual bool occludes(const Ray& r, float max_distance) const;
+
+        virtual boost::optional<Hit> find_world_hit(const Ray& r, float max_distance) const;
+        virtual Intersection world_intersection(const Ray& r, const Hit& hit) const;
+        virtual bool world_occludes(const Ray& r, float max_distance) const;
+
+        virtual ObjectKind kind() const { return ObjectKind::sphere; }
+
+        // Spheres are always transformed by at most a similarity, unless their transform is changed
+        // later. For those, rays can be intersected with the sphere in world space, using
+        // translation() as its center and scale() as its radius.
+        bool in_world_space() const { return this->transform_class() != TransformClass::general; }
     };
 
     struct Vertex {
@@ -120,6 +286,38 @@ namespace hw4 {
         unsigned int c;
     };
 
+    // The positions of the triangles of a mesh in the form used by intersection tests: the first
+    // vertex of each triangle along with the two edges leaving it. These are stored as a structure
+    // of arrays in the same order as the triangles, which is also the order of the leaves of the
+    // BVH, so that intersection tests never need to touch the full vertices.
+    class TriangleEdges {
+    public:
+        // The arrays are padded with this many degenerate triangles at the end, so that the last
+        // triangles can be loaded into full SIMD vectors
+        static constexpr size_t padding = 8;
+    private:
+        size_t m_size = 0;
+
+        std::vector<float> m_a[3];
+        std::vector<float> m_ab[3];
+        std::vector<float> m_ac[3];
+    public:
+        TriangleEdges() {}
+        TriangleEdges(const std::vector<Vertex>& vertices, const std::vector<Triangle>& triangles);
+
+        size_t size() const { return this->m_size; }
+
+        const float* a(int axis) const { return this->m_a[axis].data(); }
+        const float* ab(int axis) const { return this->m_ab[axis].data(); }
+        const float* ac(int axis) const { return this->m_ac[axis].data(); }
+
+        void get(size_t i, glm::vec3& a, glm::vec3& ab, glm::vec3& ac) const {
+            a = glm::vec3(this->m_a[0][i], this->m_a[1][i], this->m_a[2][i]);
+            ab = glm::vec3(this->m_ab[0][i], this->m_ab[1][i], this->m_ab[2][i]);
+            ac = glm::vec3(this->m_ac[0][i], this->m_ac[1][i], this->m_ac[2][i]);
+        }
+    };
+
     inline BoundingBox calc_bounding_box(const std::vector<Vertex>& vertices) {
         if (vertices.empty()) return BoundingBox();
 
@@ -143,6 +341,7 @@ namespace hw4 {
     class TriMesh {
         std::vector<Vertex> m_vertices;
         std::vector<Triangle> m_triangles;
+        TriangleEdges m_edges;
         BVH<Triangle> m_bvh;
         BoundingBox m_obb;
 
@@ -164,12 +363,15 @@ namespace hw4 {
                 )
             );
         }
+
+        // Finds the bounding box of the part of the given triangle which lies inside box
+        BoundingBox calc_triangle_clipped_bounding_box(const Triangle& t, const BoundingBox& box) const;
     public:
         TriMesh(std::vector<Vertex> vertices, std::vector<Triangle> triangles)
             : m_vertices(std::move(vertices)), m_triangles(std::move(triangles)),
               m_obb(calc_bounding_box(this->m_vertices)) {}
 
-        TriMesh& regen_bvh(size_t delta) {
+        TriMesh& regen_bvh(const BVHBuildOptions& options) {
             this->m_bvh = BVH<Triangle>::construct(
                 ([this]() {
                     std::vector<Triangle*> ts;
@@ -180,10 +382,43 @@ namespace hw4 {
 
                     return ts;
                 })(),
-                delta,
-                [this](const auto& t) { return this->calc_triangle_bounding_box(t); }
+                options,
+                [this](const auto& t) { return this->calc_triangle_bounding_box(t); },
+                [this](const auto& t, const auto& box) {
+                    return this->calc_triangle_clipped_bounding_box(t, box);
+                }
             );
 
+            // Store the triangles in the same order as the leaves of the BVH so that the triangles
+            // in each leaf are next to each other in memory. Triangles which the BVH references
+            // from more than one leaf are duplicated.
+            std::vector<Triangle> triangles;
+
+            triangles.reserve(this->m_triangles.size());
+
+            for (const auto t : this->m_bvh.objects()) {
+                triangles.push_back(*t);
+            }
+
+            this->m_triangles = std::move(triangles);
+            this->m_bvh.relocate_objects(this->m_triangles.data());
+            this->m_edges = TriangleEdges(this->m_vertices, this->m_triangles);
+
+            return *this;
+        }
+
+        // Replaces the BVH with one which was previously built by regen_bvh using the given
+        // options, after which the triangles were in their current order
+        TriMesh& restore_bvh(std::vector<BVH<Triangle>::Node> nodes, const BVHBuildOptions& options) {
+            std::vector<Triangle*> ts;
+
+            for (auto& t : this->m_triangles) {
+                ts.push_back(&t);
+            }
+
+            this->m_bvh = BVH<Triangle>::from_nodes(std::move(nodes), std::move(ts), options);
+            this->m_edges = TriangleEdges(this->m_vertices, this->m_triangles);
+
             return *this;
         }
 
@@ -191,15 +426,37 @@ namespace hw4 {
 
         const std::vector<Vertex>& vertices() const { return this->m_vertices; }
         const std::vector<Triangle>& triangles() const { return this->m_triangles; }
+        const TriangleEdges& edges() const { return this->m_edges; }
         const BVH<Triangle>& bvh() const { return this->m_bvh; }
 
-        boost::optional<Intersection> find_intersection(const Ray& r, const Triangle& t) const;
-        boost::optional<Intersection> find_intersection(const Ray& r) const;
+        // Finds the closest of the triangles [first, first + count) which the given ray hits before
+        // max_distance. Since the triangles are stored in the order of the leaves of the BVH, each
+        // leaf holds such a range.
+        bool intersect_leaf(
+            const Ray& r,
+            uint32_t first,
+            uint32_t count,
+            float max_distance,
+            Hit& hit
+        ) const;
+
+        // Checks whether the given ray hits any of the triangles [first, first + count) at or
+        // before max_distance
+        bool occludes_leaf(const Ray& r, uint32_t first, uint32_t count, float max_distance) const;
+
+        boost::optional<Hit> find_hit(const Ray& r, float max_distance) const;
+        void find_hits(const RayPacket& p, float* max_distances, boost::optional<Hit>* hits) const;
+
+        // Builds the intersection for a hit found with the given ray. The intersection has no
+        // material, since meshes don't have one.
+        Intersection intersection(const Ray& r, const Hit& hit) const;
+
+        bool occludes(const Ray& r, float max_distance) const;
 
         static std::shared_ptr<TriMesh> load_mesh(boost::filesystem::path path);
     };
 
-    class TriMeshObject : public Object {
+    class TriMeshObject final : public Object {
         std::shared_ptr<TriMesh> m_mesh;
     public:
         TriMeshObject(
@@ -210,7 +467,16 @@ namespace hw4 {
 
         const std::shared_ptr<TriMesh>& mesh() const { return this->m_mesh; }
 
-        virtual boost::optional<Intersection> find_intersection(const Ray& r) const;
+        virtual ObjectKind kind() const { return ObjectKind::mesh; }
+
+        virtual boost::optional<Hit> find_hit(const Ray& r, float max_distance) const;
+        virtual void find_hits(
+            const RayPacket& p,
+            float* max_distances,
+            boost::optional<Hit>* hits
+        ) const;
+        virtual Intersection intersection(const Ray& r, const Hit& hit) const;
+        virtual bool occludes(const Ray& r, float max_distance) const;
     };
 
     inline glm::mat4 apply_orientation(const glm::mat4& transform, const glm::vec3& rot) {
@@ -0,0 +1,64 @@
+#ifndef HW4_PARALLEL_HPP
+#define HW4_PARALLEL_HPP
+
+#include <algorithm>
+#include <future>
+#include <thread>
+#include <vector>
+
+namespace hw4 {
+    inline size_t thread_count() {
+        return std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    // The number of times that a recursive divide-and-conquer algorithm should split off work into
+    // new tasks in order to keep all threads busy.
+    inline int task_split_depth() {
+        int depth = 1;
+
+        while ((static_cast<size_t>(1) << (depth - 1)) < thread_count()) {
+            depth++;
+        }
+
+        return depth;
+    }
+
+    // The number of chunks to split n items into, given that it isn't worth starting a new thread
+    // for fewer than min_chunk items.
+    inline size_t chunk_count(size_t n, size_t min_chunk) {
+        return std::max<size_t>(1, std::min(thread_count(), n / min_chunk));
+    }
+
+    // Splits [0, n) into the given number of contiguous chunks and calls fn(chunk, start, end) on
+    // each of them in parallel, returning once all of them have finished.
+    template <typename TFn>
+    void parallel_for_chunks(size_t n, size_t chunks, const TFn& fn) {
+        if (chunks <= 1) {
+            if (n != 0) fn(0, 0, n);
+            return;
+        }
+
+        std::vector<std::future<void>> futures;
+
+        for (size_t c = 1; c < chunks; c++) {
+            futures.push_back(std::async(std::launch::async, [&fn, c, n, chunks]() {
+                fn(c, c * n / chunks, (c + 1) * n / chunks);
+            }));
+        }
+
+        fn(0, 0, n / chunks);
+
+        for (auto& f : futures) {
+            f.get();
+        }
+    }
+
+    template <typename TFn>
+    void parallel_for(size_t n, size_t min_chunk, const TFn& fn) {
+        parallel_for_chunks(n, chunk_count(n, min_chunk), [&](size_t, size_t start, size_t end) {
+            fn(start, end);
+        });
+    }
+}
+
+#endif
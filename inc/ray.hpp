@@ -1,6 +1,12 @@
 #ifndef HW4_RAY_HPP
 #define HW4_RAY_HPP
 
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+#include <glm/glm.hpp>
+
 namespace hw4 {
     class Ray {
         glm::vec3 m_origin;
@@ -10,6 +16,7 @@ namespace hw4 {
         Ray(glm::vec3 origin, glm::vec3 direction, glm::vec3 inv_direction)
             : m_origin(origin), m_direction(direction), m_inv_direction(inv_direction) {}
     public:
+        Ray() {}
         Ray(glm::vec3 origin, glm::vec3 direction)
             : m_origin(origin), m_direction(direction), m_inv_direction(1.0f / direction) {}
 
@@ -25,6 +32,11 @@ namespace hw4 {
             );
         }
 
+        // Returns a ray with the same direction starting from a different point
+        Ray with_origin(glm::vec3 origin) const {
+            return Ray(origin, this->m_direction, this->m_inv_direction);
+        }
+
         Ray transform(const glm::mat4& m, float& dist_mult) const {
             auto origin = glm::vec3(m * glm::vec4(this->m_origin, 1));
             auto direction = glm::mat3(m) * this->m_direction;
@@ -42,6 +54,74 @@ namespace hw4 {
         }
     };
 
+    // A group of rays which are traced together, sharing the work of traversing acceleration
+    // structures. This is only worthwhile for coherent rays, such as primary rays through
+    // neighbouring pixels.
+    class RayPacket {
+    public:
+        static constexpr size_t max_size = 64;
+    private:
+        Ray m_rays[max_size];
+        size_t m_size = 0;
+
+        // Bounds on the origins and inverse directions of all rays in the packet, which are used to
+        // conservatively cull boxes for the whole packet at once.
+        glm::vec3 m_origin_min;
+        glm::vec3 m_origin_max;
+        glm::vec3 m_inv_direction_min;
+        glm::vec3 m_inv_direction_max;
+    public:
+        size_t size() const { return this->m_size; }
+        bool full() const { return this->m_size == max_size; }
+
+        const Ray& operator [](size_t i) const { return this->m_rays[i]; }
+
+        const glm::vec3& origin_min() const { return this->m_origin_min; }
+        const glm::vec3& origin_max() const { return this->m_origin_max; }
+        const glm::vec3& inv_direction_min() const { return this->m_inv_direction_min; }
+        const glm::vec3& inv_direction_max() const { return this->m_inv_direction_max; }
+
+        // Whether the directions of all rays lie within the same octant. The bounds on the packet
+        // are only useful for culling if this is the case.
+        bool coherent() const {
+            for (int i = 0; i < 3; i++) {
+                bool same_sign = (this->m_inv_direction_min[i] > 0) == (this->m_inv_direction_max[i] > 0);
+                bool finite = std::isfinite(this->m_inv_direction_min[i])
+                    && std::isfinite(this->m_inv_direction_max[i]);
+
+                if (!same_sign || !finite) return false;
+            }
+
+            return true;
+        }
+
+        RayPacket& clear() {
+            this->m_size = 0;
+
+            return *this;
+        }
+
+        RayPacket& add(const Ray& r) {
+            assert(!this->full());
+
+            if (this->m_size == 0) {
+                this->m_origin_min = this->m_origin_max = r.origin();
+                this->m_inv_direction_min = this->m_inv_direction_max = r.inv_direction();
+            } else {
+                for (int i = 0; i < 3; i++) {
+                    this->m_origin_min[i] = std::min(this->m_origin_min[i], r.origin()[i]);
+                    this->m_origin_max[i] = std::max(this->m_origin_max[i], r.origin()[i]);
+                    this->m_inv_direction_min[i] = std::min(this->m_inv_direction_min[i], r.inv_direction()[i]);
+                    this->m_inv_direction_max[i] = std::max(this->m_inv_direction_max[i], r.inv_direction()[i]);
+                }
+            }
+
+            this->m_rays[this->m_size++] = r;
+
+            return *this;
+        }
+    };
+
     inline Ray operator *(const glm::mat4& m, const Ray& r) {
         float dist_mult;
 
@@ -4,6 +4,7 @@
 #include <algorithm>
 #include <functional>
 #include <memory>
+#include <vector>
 
 #include <boost/filesystem.hpp>
 #include <glm/glm.hpp>
@@ -88,6 +89,7 @@ namespace hw4 {
         int m_supersample_level;
         float m_bias;
         Camera m_camera;
+        bool m_use_packets = true;
 
         float m_img_plane_distance;
         float m_sample_spacing;
@@ -111,6 +113,14 @@ namespace hw4 {
         int max_recursion() const { return this->m_max_recursion; }
         int supersample_level() const { return this->m_supersample_level; }
         const Camera& camera() const { return this->m_camera; }
+        bool use_packets() const { return this->m_use_packets; }
+
+        // Whether primary rays should be traced through the scene in coherent packets rather than
+        // one at a time
+        RayTraceRenderer& use_packets(bool use_packets) {
+            this->m_use_packets = use_packets;
+            return *this;
+        }
 
         Image render(
             const Scene& scene,
@@ -134,11 +144,40 @@ namespace hw4 {
             return this->render_ray(scene, ray, 0);
         }
     private:
+        void render_patch_packets(
+            const Scene& scene,
+            const glm::mat4& inv_view_matrix,
+            glm::ivec2 start,
+            glm::ivec2 size,
+            std::vector<glm::vec3>& colors
+        ) const;
+        Ray primary_ray(
+            const glm::mat4& inv_view_matrix,
+            glm::ivec2 pos,
+            glm::ivec2 sample
+        ) const;
+        bool find_intersection(
+            const Scene& scene,
+            const Ray& ray,
+            Intersection& intersection
+        ) const;
+        void find_intersections(
+            const Scene& scene,
+            const RayPacket& packet,
+            float* depths,
+            Intersection* intersections
+        ) const;
         glm::vec3 render_ray(
             const Scene& scene,
             const Ray& ray,
             int recursion
         ) const;
+        glm::vec3 shade(
+            const Scene& scene,
+            const Ray& ray,
+            const Intersection& intersection,
+            int recursion
+        ) const;
         glm::vec3 render_point_light(
             const Scene& scene,
             const Ray& ray,
@@ -10,6 +10,7 @@
 
 #include "bvh.hpp"
 #include "light.hpp"
+#include "mesh_cache.hpp"
 #include "object.hpp"
 
 namespace hw4 {
@@ -33,61 +34,241 @@ namespace hw4 {
         }
     };
 
+    // A compact reference to an object, as stored in the leaves of the scene BVH. Objects are split
+    // up by kind into separate arrays so that they can be intersected without virtual calls.
+    struct ScenePrimitive {
+        ObjectKind kind;
+        uint32_t index;
+    };
+
+    // A sphere which can be intersected in world space without touching the object itself
+    struct SceneSphere {
+        glm::vec3 center;
+        float radius;
+        const SphereObject* object;
+    };
+
     class Scene {
         std::map<std::string, Camera> m_cameras;
+        std::map<std::string, std::shared_ptr<TriMesh>> m_models;
         std::vector<std::unique_ptr<Object>> m_objects;
         std::vector<std::unique_ptr<PointLight>> m_point_lights;
 
-        BVH<Object> m_bvh;
+        // The objects in the order of the leaves of the BVH, and the primitives referring to them
+        // in the same order
+        std::vector<const Object*> m_leaf_objects;
+        std::vector<ScenePrimitive> m_primitives;
+
+        std::vector<SceneSphere> m_spheres;
+        std::vector<const TriMeshObject*> m_meshes;
+        std::vector<const Object*> m_other_objects;
+
+        BVH<ScenePrimitive> m_bvh;
+
+        // Rebuilds the primitives and the arrays of each kind of object from m_leaf_objects
+        void update_primitives() {
+            this->m_primitives.clear();
+            this->m_spheres.clear();
+            this->m_meshes.clear();
+            this->m_other_objects.clear();
+
+            for (auto o : this->m_leaf_objects) {
+                auto kind = o->kind();
+                uint32_t index;
+
+                const SphereObject* sphere = nullptr;
+
+                if (kind == ObjectKind::sphere) {
+                    sphere = static_cast<const SphereObject*>(o);
+                }
+
+                // Spheres with a general transform go through the generic path
+                if (sphere && sphere->in_world_space()) {
+                    index = static_cast<uint32_t>(this->m_spheres.size());
+                    this->m_spheres.push_back(SceneSphere {
+                        sphere->translation(),
+                        sphere->scale(),
+                        sphere
+                    });
+                } else if (kind == ObjectKind::mesh) {
+                    index = static_cast<uint32_t>(this->m_meshes.size());
+                    this->m_meshes.push_back(static_cast<const TriMeshObject*>(o));
+                } else {
+                    kind = ObjectKind::other;
+                    index = static_cast<uint32_t>(this->m_other_objects.size());
+                    this->m_other_objects.push_back(o);
+                }
+
+                this->m_primitives.push_back(ScenePrimitive { kind, index });
+            }
+
+            this->m_bvh.relocate_objects(this->m_primitives.data());
+        }
     public:
         Scene() {}
 
         const std::map<std::string, Camera>& cameras() const { return this->m_cameras; }
         std::map<std::string, Camera>& cameras() { return this->m_cameras; }
 
+        const std::map<std::string, std::shared_ptr<TriMesh>>& models() const { return this->m_models; }
+        std::map<std::string, std::shared_ptr<TriMesh>>& models() { return this->m_models; }
+
         const std::vector<std::unique_ptr<Object>>& objects() const { return this->m_objects; }
         std::vector<std::unique_ptr<Object>>& objects() { return this->m_objects; }
 
         const auto& point_lights() const { return this->m_point_lights; }
         auto& point_lights() { return this->m_point_lights; }
 
-        const BVH<Object>& bvh() const { return this->m_bvh; }
-        Scene& regen_mesh_bvhs(size_t delta) {
-            std::vector<TriMesh*> meshes;
+        const BVH<ScenePrimitive>& bvh() const { return this->m_bvh; }
 
-            for (const auto& obj : this->m_objects) {
-                auto mesh_obj = dynamic_cast<TriMeshObject*>(obj.get());
+        const Object& object(const ScenePrimitive& p) const {
+            switch (p.kind) {
+                case ObjectKind::sphere:
+                    return *this->m_spheres[p.index].object;
+                case ObjectKind::mesh:
+                    return *this->m_meshes[p.index];
+                default:
+                    return *this->m_other_objects[p.index];
+            }
+        }
 
-                if (mesh_obj) {
-                    if (std::find(meshes.begin(), meshes.end(), mesh_obj->mesh().get()) == meshes.end()) {
-                        meshes.push_back(mesh_obj->mesh().get());
+        // Equivalent to object(p).find_world_hit(r, max_distance), but dispatched on the kind of
+        // the primitive so that spheres and meshes can be intersected without virtual calls
+        boost::optional<Hit> find_world_hit(
+            const ScenePrimitive& p,
+            const Ray& r,
+            float max_distance
+        ) const {
+            switch (p.kind) {
+                case ObjectKind::sphere: {
+                    const auto& s = this->m_spheres[p.index];
+                    float t;
+
+                    if (!intersect_sphere(r, s.center, s.radius, t) || t > max_distance) {
+                        return boost::none;
                     }
+
+                    return Hit { t, 1, 0, 0, 0 };
+                }
+                case ObjectKind::mesh: {
+                    const auto& o = *this->m_meshes[p.index];
+
+                    return o.find_world_hit_using(r, max_distance, [&](const Ray& obj_ray, float obj_distance) {
+                        return o.mesh()->find_hit(obj_ray, obj_distance);
+                    });
+                }
+                default:
+                    return this->m_other_objects[p.index]->find_world_hit(r, max_distance);
+            }
+        }
+
+        // Equivalent to object(p).world_occludes(r, max_distance), dispatched like find_world_hit
+        bool world_occludes(const ScenePrimitive& p, const Ray& r, float max_distance) const {
+            switch (p.kind) {
+                case ObjectKind::sphere: {
+                    const auto& s = this->m_spheres[p.index];
+                    float t;
+
+                    return intersect_sphere(r, s.center, s.radius, t) && t <= max_distance;
+                }
+                case ObjectKind::mesh: {
+                    const auto& o = *this->m_meshes[p.index];
+
+                    return o.world_occludes_using(r, max_distance, [&](const Ray& obj_ray, float obj_distance) {
+                        return o.mesh()->occludes(obj_ray, obj_distance);
+                    });
+                }
+                default:
+                    return this->m_other_objects[p.index]->world_occludes(r, max_distance);
+            }
+        }
+
+        // Builds the BVHs of all of the meshes in the scene. If the meshes were loaded through a
+        // cache, only those which weren't found in it are built, and they're added to it.
+        Scene& regen_mesh_bvhs(const BVHBuildOptions& options, const MeshCache* mesh_cache = nullptr) {
+            std::vector<std::shared_ptr<TriMesh>> meshes;
+
+            for (const auto& obj : this->m_objects) {
+                if (obj->kind() != ObjectKind::mesh) continue;
+
+                const auto& mesh = static_cast<TriMeshObject*>(obj.get())->mesh();
+
+                if (std::find(meshes.begin(), meshes.end(), mesh) == meshes.end()) {
+                    meshes.push_back(mesh);
                 }
             }
 
-            for (auto mesh : meshes) {
-                mesh->regen_bvh(delta);
+            // Each build already splits its work across all of the cores, so building the meshes
+            // one at a time keeps the machine busy without oversubscribing it
+            for (const auto& mesh : meshes) {
+                if (mesh_cache) {
+                    mesh_cache->build_bvh(mesh);
+                } else {
+                    mesh->regen_bvh(options);
+                }
             }
 
             return *this;
         }
-        Scene& regen_bvh(size_t delta) {
-            std::vector<Object*> objects;
 
-            for (const auto& o : this->m_objects) {
-                objects.push_back(o.get());
+        Scene& regen_bvh(const BVHBuildOptions& options) {
+            // The tree is first built over primitives which just refer to objects by their index,
+            // and these are replaced by the real primitives once the order of the leaves is known
+            std::vector<ScenePrimitive> unordered;
+            std::vector<ScenePrimitive*> primitives;
+
+            for (size_t i = 0; i < this->m_objects.size(); i++) {
+                unordered.push_back(ScenePrimitive { ObjectKind::other, static_cast<uint32_t>(i) });
             }
 
-            this->m_bvh = BVH<Object>::construct(
-                objects,
-                delta,
-                [](const auto& o) { return o.aabb(); }
+            for (auto& p : unordered) {
+                primitives.push_back(&p);
+            }
+
+            // Intersecting an object (especially a mesh) is much more expensive than the cost model
+            // used to pick leaf sizes assumes, so always give each object its own leaf.
+            auto scene_options = options;
+
+            scene_options.max_leaf_size = 1;
+
+            // The scene BVH is small, so there's nothing to gain from compressing it
+            scene_options.quantize = false;
+
+            // Objects can only be split by clipping their bounding boxes, which is rarely worth the
+            // cost of testing them more than once
+            if (scene_options.method == BVHBuildMethod::sbvh) {
+                scene_options.method = BVHBuildMethod::sah;
+            }
+
+            this->m_bvh = BVH<ScenePrimitive>::construct(
+                primitives,
+                scene_options,
+                [this](const auto& p) { return this->m_objects[p.index]->aabb(); }
             );
 
+            this->m_leaf_objects.clear();
+
+            for (auto p : this->m_bvh.objects()) {
+                this->m_leaf_objects.push_back(this->m_objects[p->index].get());
+            }
+
+            this->update_primitives();
+
             return *this;
         }
 
-        static Scene load_scene(boost::filesystem::path path);
+        // Updates the scene BVH after objects have been moved using Object::transform, returning
+        // how much more expensive it has become to trace relative to when it was last rebuilt (see
+        // BVH::refit). Once this grows too large, regen_bvh should be used instead.
+        float refit_bvh() {
+            this->update_primitives();
+
+            return this->m_bvh.refit([this](const auto& p) { return this->object(p).aabb(); });
+        }
+
+        // Loads a scene from the given file. If a mesh cache is given, models are loaded through
+        // it and will already have their BVHs built.
+        static Scene load_scene(boost::filesystem::path path, const MeshCache* mesh_cache = nullptr);
     };
 }
 
@@ -0,0 +1,214 @@
+#ifndef HW4_SIMD_HPP
+#define HW4_SIMD_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+namespace hw4 {
+    namespace simd {
+        // Thin wrappers around SIMD vectors of floats so that kernels can be written once for any
+        // width. Where the necessary instruction sets aren't available at compile time, these fall
+        // back to plain loops which the compiler may still be able to vectorize.
+#if defined(__SSE2__)
+        struct float4 {
+            static constexpr size_t width = 4;
+
+            __m128 v;
+
+            float4() {}
+            float4(__m128 v) : v(v) {}
+            explicit float4(float s) : v(_mm_set1_ps(s)) {}
+
+            static float4 load(const float* p) { return _mm_loadu_ps(p); }
+            void store(float* p) const { _mm_storeu_ps(p, this->v); }
+
+            // Loads 4 bytes and converts them to floats
+            static float4 load_u8(const uint8_t* p) {
+                int32_t bytes;
+
+                std::memcpy(&bytes, p, sizeof(bytes));
+
+                __m128i zero = _mm_setzero_si128();
+                __m128i v = _mm_cvtsi32_si128(bytes);
+
+                v = _mm_unpacklo_epi8(v, zero);
+                v = _mm_unpacklo_epi16(v, zero);
+
+                return _mm_cvtepi32_ps(v);
+            }
+        };
+
+        inline float4 operator +(float4 a, float4 b) { return _mm_add_ps(a.v, b.v); }
+        inline float4 operator -(float4 a, float4 b) { return _mm_sub_ps(a.v, b.v); }
+        inline float4 operator *(float4 a, float4 b) { return _mm_mul_ps(a.v, b.v); }
+        inline float4 operator /(float4 a, float4 b) { return _mm_div_ps(a.v, b.v); }
+        inline float4 min(float4 a, float4 b) { return _mm_min_ps(a.v, b.v); }
+        inline float4 max(float4 a, float4 b) { return _mm_max_ps(a.v, b.v); }
+
+        // Returns a bitmask with bit i set if a[i] <= b[i]
+        inline unsigned int less_equal(float4 a, float4 b) {
+            return static_cast<unsigned int>(_mm_movemask_ps(_mm_cmple_ps(a.v, b.v)));
+        }
+
+        // Returns a bitmask with bit i set if a[i] < b[i]
+        inline unsigned int less(float4 a, float4 b) {
+            return static_cast<unsigned int>(_mm_movemask_ps(_mm_cmplt_ps(a.v, b.v)));
+        }
+#else
+        struct float4 {
+            static constexpr size_t width = 4;
+
+            float v[4];
+
+            float4() {}
+            explicit float4(float s) : v { s, s, s, s } {}
+
+            static float4 load(const float* p) {
+                float4 r;
+
+                std::copy(p, p + 4, r.v);
+                return r;
+            }
+
+            void store(float* p) const { std::copy(this->v, this->v + 4, p); }
+
+            static float4 load_u8(const uint8_t* p) {
+                float4 r;
+
+                for (int i = 0; i < 4; i++) r.v[i] = p[i];
+                return r;
+            }
+        };
+
+        template <typename TFn>
+        inline float4 map(float4 a, float4 b, const TFn& fn) {
+            float4 r;
+
+            for (int i = 0; i < 4; i++) r.v[i] = fn(a.v[i], b.v[i]);
+            return r;
+        }
+
+        inline float4 operator +(float4 a, float4 b) { return map(a, b, [](float x, float y) { return x + y; }); }
+        inline float4 operator -(float4 a, float4 b) { return map(a, b, [](float x, float y) { return x - y; }); }
+        inline float4 operator *(float4 a, float4 b) { return map(a, b, [](float x, float y) { return x * y; }); }
+        inline float4 operator /(float4 a, float4 b) { return map(a, b, [](float x, float y) { return x / y; }); }
+        inline float4 min(float4 a, float4 b) { return map(a, b, [](float x, float y) { return x < y ? x : y; }); }
+        inline float4 max(float4 a, float4 b) { return map(a, b, [](float x, float y) { return x > y ? x : y; }); }
+
+        inline unsigned int less_equal(float4 a, float4 b) {
+            unsigned int mask = 0;
+
+            for (int i = 0; i < 4; i++) {
+                if (a.v[i] <= b.v[i]) mask |= 1u << i;
+            }
+
+            return mask;
+        }
+
+        inline unsigned int less(float4 a, float4 b) {
+            unsigned int mask = 0;
+
+            for (int i = 0; i < 4; i++) {
+                if (a.v[i] < b.v[i]) mask |= 1u << i;
+            }
+
+            return mask;
+        }
+#endif
+
+#if defined(__AVX__)
+        struct float8 {
+            static constexpr size_t width = 8;
+
+            __m256 v;
+
+            float8() {}
+            float8(__m256 v) : v(v) {}
+            explicit float8(float s) : v(_mm256_set1_ps(s)) {}
+
+            static float8 load(const float* p) { return _mm256_loadu_ps(p); }
+            void store(float* p) const { _mm256_storeu_ps(p, this->v); }
+
+            static float8 load_u8(const uint8_t* p) {
+                return _mm256_insertf128_ps(
+                    _mm256_castps128_ps256(float4::load_u8(p).v),
+                    float4::load_u8(p + 4).v,
+                    1
+                );
+            }
+        };
+
+        inline float8 operator +(float8 a, float8 b) { return _mm256_add_ps(a.v, b.v); }
+        inline float8 operator -(float8 a, float8 b) { return _mm256_sub_ps(a.v, b.v); }
+        inline float8 operator *(float8 a, float8 b) { return _mm256_mul_ps(a.v, b.v); }
+        inline float8 operator /(float8 a, float8 b) { return _mm256_div_ps(a.v, b.v); }
+        inline float8 min(float8 a, float8 b) { return _mm256_min_ps(a.v, b.v); }
+        inline float8 max(float8 a, float8 b) { return _mm256_max_ps(a.v, b.v); }
+
+        inline unsigned int less_equal(float8 a, float8 b) {
+            return static_cast<unsigned int>(_mm256_movemask_ps(_mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ)));
+        }
+
+        inline unsigned int less(float8 a, float8 b) {
+            return static_cast<unsigned int>(_mm256_movemask_ps(_mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ)));
+        }
+#else
+        // Without AVX, 8-wide vectors are just handled as two 4-wide halves
+        struct float8 {
+            static constexpr size_t width = 8;
+
+            float4 lo;
+            float4 hi;
+
+            float8() {}
+            float8(float4 lo, float4 hi) : lo(lo), hi(hi) {}
+            explicit float8(float s) : lo(s), hi(s) {}
+
+            static float8 load(const float* p) { return float8(float4::load(p), float4::load(p + 4)); }
+            void store(float* p) const { this->lo.store(p); this->hi.store(p + 4); }
+
+            static float8 load_u8(const uint8_t* p) {
+                return float8(float4::load_u8(p), float4::load_u8(p + 4));
+            }
+        };
+
+        inline float8 operator +(float8 a, float8 b) { return float8(a.lo + b.lo, a.hi + b.hi); }
+        inline float8 operator -(float8 a, float8 b) { return float8(a.lo - b.lo, a.hi - b.hi); }
+        inline float8 operator *(float8 a, float8 b) { return float8(a.lo * b.lo, a.hi * b.hi); }
+        inline float8 operator /(float8 a, float8 b) { return float8(a.lo / b.lo, a.hi / b.hi); }
+        inline float8 min(float8 a, float8 b) { return float8(min(a.lo, b.lo), min(a.hi, b.hi)); }
+        inline float8 max(float8 a, float8 b) { return float8(max(a.lo, b.lo), max(a.hi, b.hi)); }
+
+        inline unsigned int less_equal(float8 a, float8 b) {
+            return less_equal(a.lo, b.lo) | (less_equal(a.hi, b.hi) << 4);
+        }
+
+        inline unsigned int less(float8 a, float8 b) {
+            return less(a.lo, b.lo) | (less(a.hi, b.hi) << 4);
+        }
+#endif
+
+        // The widest vector type which the target supports natively
+#if defined(__AVX__)
+        typedef float8 float_native;
+#else
+        typedef float4 float_native;
+#endif
+
+        // Maps a width to the vector type of that width
+        template <size_t N> struct float_n;
+        template <> struct float_n<4> { typedef float4 type; };
+        template <> struct float_n<8> { typedef float8 type; };
+    }
+}
+
+#endif
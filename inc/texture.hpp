@@ -2,7 +2,14 @@
 #define HW4_TEXTURE_HPP
 
 #include <cassert>
+#include <cstdint>
+#include <future>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
 
 #include <glm/glm.hpp>
 
@@ -57,8 +64,40 @@ namespace hw4 {
             );
         }
 
+        // Decodes an image file which has already been read into memory. The path is only used for
+        // error messages.
+        static std::shared_ptr<Texture2D> decode(
+            const std::vector<unsigned char>& data,
+            const std::string& path
+        );
         static std::shared_ptr<Texture2D> load(const std::string& path);
     };
+
+    // Loads textures, decoding each distinct image only once. Requests for the same path, or for
+    // different files with identical contents, all share a single texture. Textures may be
+    // requested from several threads at once, in which case only one of them does the decoding
+    // and the rest wait for it.
+    class TextureCache {
+        typedef std::shared_future<std::shared_ptr<Texture2D>> TextureFuture;
+
+        // The file a texture was decoded from, so that a file with a matching hash and size can
+        // be compared with it byte for byte before the texture is shared
+        struct ContentsEntry {
+            std::string path;
+            TextureFuture texture;
+        };
+
+        std::mutex m_mutex;
+        std::map<std::string, TextureFuture> m_by_path;
+        std::map<std::pair<uint64_t, size_t>, ContentsEntry> m_by_contents;
+    public:
+        TextureCache() {}
+        TextureCache(const TextureCache& other) = delete;
+
+        TextureCache& operator =(const TextureCache& other) = delete;
+
+        std::shared_ptr<Texture2D> load(const std::string& path);
+    };
 }
 
 #endif
@@ -1,4 +1,11 @@
 #include <algorithm>
+#include <array>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+
+#define HW4_HAS_BMI2_DISPATCH
+#endif
 
 #include "bvh.hpp"
 
@@ -22,4 +29,122 @@ namespace hw4 {
 
         return BoundingBox(min, max);
     }
+
+#ifdef HW4_HAS_BMI2_DISPATCH
+    // Spreads the top 21 bits of each coordinate across every third bit in a single instruction
+    // each, giving the same result as morton_code(uint32_t, uint32_t, uint32_t)
+    __attribute__((target("bmi2")))
+    static void compute_morton_keys_bmi2(
+        const std::vector<BoundingBox>& boxes,
+        const BoundingBox& total,
+        std::vector<MortonKey>& keys,
+        size_t start,
+        size_t end
+    ) {
+        constexpr uint64_t mask = 0x1249249249249249;
+
+        for (size_t i = start; i < end; i++) {
+            auto q = morton_quantize(morton_position(boxes[i], total));
+
+            keys[i].code = _pdep_u64(q.x >> 11, mask)
+                | _pdep_u64(q.y >> 11, mask << 1)
+                | _pdep_u64(q.z >> 11, mask << 2);
+            keys[i].index = static_cast<uint32_t>(i);
+        }
+    }
+#endif
+
+    void compute_morton_keys(
+        const std::vector<BoundingBox>& boxes,
+        const BoundingBox& total,
+        std::vector<MortonKey>& keys
+    ) {
+        size_t n = boxes.size();
+
+        keys.resize(n);
+
+#ifdef HW4_HAS_BMI2_DISPATCH
+        static const bool has_bmi2 = __builtin_cpu_supports("bmi2");
+
+        if (has_bmi2) {
+            parallel_for(n, 16384, [&](size_t start, size_t end) {
+                compute_morton_keys_bmi2(boxes, total, keys, start, end);
+            });
+
+            return;
+        }
+#endif
+
+        parallel_for(n, 16384, [&](size_t start, size_t end) {
+            for (size_t i = start; i < end; i++) {
+                keys[i] = MortonKey { morton_code(boxes[i], total), static_cast<uint32_t>(i) };
+            }
+        });
+    }
+
+    void sort_morton_keys(std::vector<MortonKey>& keys) {
+        constexpr int radix_bits = 11;
+        constexpr size_t num_buckets = static_cast<size_t>(1) << radix_bits;
+
+        size_t n = keys.size();
+        size_t chunks = chunk_count(n, 16384);
+
+        std::vector<MortonKey> sorted(n);
+        std::vector<std::array<size_t, num_buckets>> offsets(chunks);
+
+        auto bucket = [](const MortonKey& k, int shift) {
+            return static_cast<size_t>((k.code >> shift) & (num_buckets - 1));
+        };
+
+        for (int shift = 0; shift < 64; shift += radix_bits) {
+            parallel_for_chunks(n, chunks, [&](size_t c, size_t start, size_t end) {
+                auto& counts = offsets[c];
+
+                counts.fill(0);
+
+                for (size_t i = start; i < end; i++) {
+                    counts[bucket(keys[i], shift)]++;
+                }
+            });
+
+            // If every key has the same digit then this pass wouldn't move anything. This is
+            // always true of the top bits, which Morton codes don't use.
+            bool trivial = false;
+
+            for (size_t b = 0; b < num_buckets && !trivial; b++) {
+                size_t count = 0;
+
+                for (size_t c = 0; c < chunks; c++) {
+                    count += offsets[c][b];
+                }
+
+                trivial = count == n;
+            }
+
+            if (trivial) continue;
+
+            // Each chunk writes its keys for a bucket after those of all earlier chunks, which keeps
+            // every pass stable.
+            size_t offset = 0;
+
+            for (size_t b = 0; b < num_buckets; b++) {
+                for (size_t c = 0; c < chunks; c++) {
+                    size_t count = offsets[c][b];
+
+                    offsets[c][b] = offset;
+                    offset += count;
+                }
+            }
+
+            parallel_for_chunks(n, chunks, [&](size_t c, size_t start, size_t end) {
+                auto& chunk_offsets = offsets[c];
+
+                for (size_t i = start; i < end; i++) {
+                    sorted[chunk_offsets[bucket(keys[i], shift)]++] = keys[i];
+                }
+            });
+
+            keys.swap(sorted);
+        }
+    }
 }
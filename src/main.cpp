@@ -1,6 +1,7 @@
 #include <atomic>
 #include <chrono>
 #include <cstdlib>
+#include <fstream>
 #include <future>
 #include <iomanip>
 #include <iostream>
@@ -16,11 +17,17 @@
 namespace hw4 {
     struct ProgramOptions {
         bool no_preview;
+        bool no_packets;
         int supersample_level;
         int max_recursion;
         float bias;
         glm::ivec2 size;
 
+        BVHBuildOptions bvh_options;
+        bool bvh_stats;
+        boost::filesystem::path bvh_dump;
+        boost::filesystem::path mesh_cache;
+
         boost::filesystem::path scene;
         std::string camera;
         boost::filesystem::path output;
@@ -50,6 +57,46 @@ namespace hw4 {
         s << std::flush;
     }
 
+    void print_bvh_stats(const std::string& name, const BVHStats& stats, std::ostream& s) {
+        s << name << ":\n"
+          << "  Nodes:           " << stats.nodes << " (" << stats.leaves << " leaves)\n"
+          << "  Depth:           " << stats.max_depth << " max, " << stats.average_depth
+          << " average\n"
+          << "  SAH cost:        " << stats.sah_cost << "\n"
+          << "  Sibling overlap: " << stats.sibling_overlap << "\n"
+          << "  Memory:          " << stats.memory / 1024.0 << " KiB\n";
+    }
+
+    void show_bvh_stats(const Scene& scene) {
+        print_bvh_stats("Scene", scene.bvh().stats(), std::cout);
+
+        for (const auto& m : scene.models()) {
+            print_bvh_stats("Model \"" + m.first + "\"", m.second->bvh().stats(), std::cout);
+        }
+    }
+
+    void dump_bvhs(const Scene& scene, const boost::filesystem::path& path) {
+        std::ofstream f(path.string());
+
+        if (!f) {
+            throw std::runtime_error(([&]() {
+                std::ostringstream ss;
+
+                ss << "Failed to open BVH dump file \"" << path.string() << "\"";
+
+                return ss.str();
+            })());
+        }
+
+        f << "# scene\n";
+        scene.bvh().dump(f);
+
+        for (const auto& m : scene.models()) {
+            f << "# model " << m.first << "\n";
+            m.second->bvh().dump(f);
+        }
+    }
+
     void wait_with_spinner(std::future<void> f) {
         int state = 0;
 
@@ -163,6 +210,8 @@ namespace hw4 {
         );
         Image img;
 
+        render.use_packets(!options.no_packets);
+
         std::cout << "Generating preview...";
         render_with_progress(
             render,
@@ -183,6 +232,8 @@ namespace hw4 {
         );
         Image img;
 
+        render.use_packets(!options.no_packets);
+
         std::cout << "Generating full-size image...";
         render_with_progress(
             render,
@@ -229,6 +280,23 @@ namespace hw4 {
         }
     }
 
+    void validate(boost::any& v, const std::vector<std::string>& values, BVHBuildMethod*, int) {
+        namespace po = boost::program_options;
+
+        po::validators::check_first_occurrence(v);
+        const std::string& s = po::validators::get_single_string(values);
+
+        if (s == "aac") {
+            v = BVHBuildMethod::aac;
+        } else if (s == "sah") {
+            v = BVHBuildMethod::sah;
+        } else if (s == "sbvh") {
+            v = BVHBuildMethod::sbvh;
+        } else {
+            throw po::validation_error(po::validation_error::invalid_option_value);
+        }
+    }
+
     boost::optional<ProgramOptions> parse_options(int argc, char** argv) {
         namespace po = boost::program_options;
 
@@ -242,6 +310,7 @@ namespace hw4 {
         po::options_description render_options("Render Options");
         render_options.add_options()
             ("no-preview", "Skip generating a preview image")
+            ("no-packets", "Trace view rays one at a time instead of in coherent packets")
             (
                 "camera,c",
                 po::value<std::string>()
@@ -278,6 +347,66 @@ namespace hw4 {
                 "The size (in pixels) of the image to generate"
             );
 
+        po::options_description bvh_options("BVH Options");
+        bvh_options.add_options()
+            (
+                "bvh-builder",
+                po::value<BVHBuildMethod>()
+                    ->value_name("<aac|sah|sbvh>")
+                    ->default_value(BVHBuildMethod::aac, "aac"),
+                "The algorithm used to build BVHs (aac builds quickly, sah builds trees that trace "
+                "faster, sbvh also splits large triangles between nodes)"
+            )
+            (
+                "bvh-width",
+                po::value<int>()
+                    ->value_name("<2|4|8>")
+                    ->default_value(4),
+                "The number of children per BVH node used when tracing rays"
+            )
+            (
+                "bvh-delta",
+                po::value<int>()
+                    ->value_name("<n>")
+                    ->default_value(20),
+                "The number of objects at which the aac builder switches to clustering (larger "
+                "values build slower, better trees)"
+            )
+            (
+                "bvh-leaf-size",
+                po::value<int>()
+                    ->value_name("<n>")
+                    ->default_value(8),
+                "The maximum number of triangles in a single leaf of a model BVH"
+            )
+            (
+                "bvh-split-budget",
+                po::value<float>()
+                    ->value_name("<f>")
+                    ->default_value(0.3f),
+                "Allow the sbvh builder to add up to f times as many extra triangle references as "
+                "there are triangles in a model"
+            )
+            (
+                "bvh-quantize",
+                "Store model BVH nodes in a compressed form which uses less memory (requires a BVH "
+                "width of 4 or 8)"
+            )
+            ("bvh-stats", "Print statistics about the scene and model BVHs instead of rendering")
+            (
+                "bvh-dump",
+                po::value<std::string>()
+                    ->value_name("<filename>"),
+                "Write the structure of the scene and model BVHs to a text file"
+            )
+            (
+                "mesh-cache",
+                po::value<std::string>()
+                    ->value_name("<directory>"),
+                "Cache models and their BVHs in the given directory so that later runs can skip "
+                "parsing and building them"
+            );
+
         po::options_description general_options("General Options");
         general_options.add_options()
             (
@@ -292,6 +421,7 @@ namespace hw4 {
         po::options_description all_options;
         all_options.add(hidden_options);
         all_options.add(render_options);
+        all_options.add(bvh_options);
         all_options.add(general_options);
 
         po::variables_map vm;
@@ -314,6 +444,7 @@ namespace hw4 {
             std::cerr << "Usage: " << argv[0] << " [options...] <scene>\n"
                       << "Simple Whitted Ray Tracer v0.1\n"
                       << render_options
+                      << bvh_options
                       << general_options;
             return boost::none;
         }
@@ -324,14 +455,67 @@ namespace hw4 {
             return boost::none;
         }
 
+        int bvh_width = vm["bvh-width"].as<int>();
+
+        if (bvh_width != 2 && bvh_width != 4 && bvh_width != 8) {
+            std::cerr << argv[0] << ": BVH width must be 2, 4, or 8\nUse " << argv[0]
+                      << " -h for help\n";
+            return boost::none;
+        }
+
+        if (bvh_width == 2 && vm.count("bvh-quantize")) {
+            std::cerr << argv[0] << ": BVH quantization requires a BVH width of 4 or 8\nUse "
+                      << argv[0] << " -h for help\n";
+            return boost::none;
+        }
+
+        int bvh_delta = vm["bvh-delta"].as<int>();
+
+        if (bvh_delta < 1) {
+            std::cerr << argv[0] << ": BVH delta must be at least 1\nUse " << argv[0]
+                      << " -h for help\n";
+            return boost::none;
+        }
+
+        int bvh_leaf_size = vm["bvh-leaf-size"].as<int>();
+
+        if (bvh_leaf_size < 1) {
+            std::cerr << argv[0] << ": BVH leaf size must be at least 1\nUse " << argv[0]
+                      << " -h for help\n";
+            return boost::none;
+        }
+
+        if (vm["bvh-split-budget"].as<float>() < 0) {
+            std::cerr << argv[0] << ": BVH split budget must not be negative\nUse " << argv[0]
+                      << " -h for help\n";
+            return boost::none;
+        }
+
         ProgramOptions result;
 
         result.no_preview = vm.count("no-preview") > 0;
+        result.no_packets = vm.count("no-packets") > 0;
         result.supersample_level = vm["supersample"].as<int>();
         result.max_recursion = vm["max-recursion"].as<int>();
         result.bias = vm["bias"].as<float>();
         result.size = vm["size"].as<option_ivec2>();
 
+        result.bvh_options.method = vm["bvh-builder"].as<BVHBuildMethod>();
+        result.bvh_options.width = static_cast<size_t>(bvh_width);
+        result.bvh_options.delta = static_cast<size_t>(bvh_delta);
+        result.bvh_options.max_leaf_size = static_cast<size_t>(bvh_leaf_size);
+        result.bvh_options.quantize = vm.count("bvh-quantize") > 0;
+        result.bvh_options.split_budget = vm["bvh-split-budget"].as<float>();
+        result.bvh_stats = vm.count("bvh-stats") > 0;
+
+        if (vm.count("bvh-dump")) {
+            result.bvh_dump = vm["bvh-dump"].as<std::string>();
+        }
+
+        if (vm.count("mesh-cache")) {
+            result.mesh_cache = vm["mesh-cache"].as<std::string>();
+        }
+
         result.scene = vm["scene"].as<std::string>();
         result.camera = vm["camera"].as<std::string>();
         result.output = vm["-o"].as<std::string>();
@@ -348,10 +532,15 @@ namespace hw4 {
 
         Scene scene;
         Camera camera;
+        std::unique_ptr<MeshCache> mesh_cache;
+
+        if (!options->mesh_cache.empty()) {
+            mesh_cache = std::make_unique<MeshCache>(options->mesh_cache, options->bvh_options);
+        }
 
         std::cout << "Loading scene...";
         wait_with_spinner(std::async([&]() {
-            scene = Scene::load_scene(options->scene);
+            scene = Scene::load_scene(options->scene, mesh_cache.get());
 
             auto camera_it = scene.cameras().find(options->camera);
 
@@ -370,14 +559,23 @@ namespace hw4 {
 
         std::cout << "Building mesh BVHs...";
         wait_with_spinner(std::async([&]() {
-            scene.regen_mesh_bvhs(100);
+            scene.regen_mesh_bvhs(options->bvh_options, mesh_cache.get());
         }));
 
         std::cout << "Building scene BVH...";
         wait_with_spinner(std::async([&]() {
-            scene.regen_bvh(100);
+            scene.regen_bvh(options->bvh_options);
         }));
 
+        if (!options->bvh_dump.empty()) {
+            dump_bvhs(scene, options->bvh_dump);
+        }
+
+        if (options->bvh_stats) {
+            show_bvh_stats(scene);
+            return 0;
+        }
+
         if (!options->no_preview) show_scene(scene, camera, *options);
         render_scene(scene, camera, *options);
 
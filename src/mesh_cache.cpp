@@ -0,0 +1,243 @@
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <type_traits>
+
+#include <boost/filesystem/fstream.hpp>
+
+#include "hash.hpp"
+#include "mesh_cache.hpp"
+
+namespace hw4 {
+    // Bump this whenever the layout of cache entries or of the types stored in them changes
+    static constexpr uint64_t mesh_cache_version = 1;
+
+    struct MeshCacheHeader {
+        char magic[8];
+        uint64_t key;
+        uint64_t num_vertices;
+        uint64_t num_triangles;
+        uint64_t num_nodes;
+    };
+
+    static const char mesh_cache_magic[8] = { 'H', 'W', '4', 'M', 'E', 'S', 'H', '\0' };
+
+    static_assert(std::is_trivially_copyable<Vertex>::value, "Vertices must be trivially copyable");
+    static_assert(std::is_trivially_copyable<Triangle>::value, "Triangles must be trivially copyable");
+    static_assert(
+        std::is_trivially_copyable<BVH<Triangle>::Node>::value,
+        "BVH nodes must be trivially copyable"
+    );
+
+    template <typename T>
+    static bool read_array(std::istream& s, std::vector<T>& v, uint64_t size) {
+        v.resize(size);
+        s.read(reinterpret_cast<char*>(v.data()), size * sizeof(T));
+
+        return static_cast<bool>(s);
+    }
+
+    template <typename T>
+    static void write_array(std::ostream& s, const std::vector<T>& v) {
+        s.write(reinterpret_cast<const char*>(v.data()), v.size() * sizeof(T));
+    }
+
+    boost::filesystem::path MeshCache::entry_path(uint64_t key) const {
+        std::ostringstream ss;
+
+        ss << std::hex << key << ".mesh";
+
+        return this->m_dir / ss.str();
+    }
+
+    std::shared_ptr<TriMesh> MeshCache::read_entry(
+        const boost::filesystem::path& path,
+        uint64_t key
+    ) const {
+        boost::system::error_code ec;
+        auto file_size = boost::filesystem::file_size(path, ec);
+
+        if (ec || file_size < sizeof(MeshCacheHeader)) return nullptr;
+
+        boost::filesystem::ifstream f(path, std::ios::binary);
+        MeshCacheHeader header;
+
+        if (!f.read(reinterpret_cast<char*>(&header), sizeof(header))) return nullptr;
+
+        // Check the size of the file before allocating anything so that a corrupted header can't
+        // cause huge allocations
+        bool valid = std::memcmp(header.magic, mesh_cache_magic, sizeof(header.magic)) == 0
+            && header.key == key
+            && header.num_vertices <= file_size
+            && header.num_triangles <= file_size
+            && header.num_nodes <= file_size
+            && file_size == sizeof(MeshCacheHeader)
+                + header.num_vertices * sizeof(Vertex)
+                + header.num_triangles * sizeof(Triangle)
+                + header.num_nodes * sizeof(BVH<Triangle>::Node);
+
+        if (!valid) return nullptr;
+
+        std::vector<Vertex> vertices;
+        std::vector<Triangle> triangles;
+        std::vector<BVH<Triangle>::Node> nodes;
+
+        if (
+            !read_array(f, vertices, header.num_vertices)
+            || !read_array(f, triangles, header.num_triangles)
+            || !read_array(f, nodes, header.num_nodes)
+        ) {
+            return nullptr;
+        }
+
+        for (const auto& t : triangles) {
+            if (t.a >= vertices.size() || t.b >= vertices.size() || t.c >= vertices.size()) {
+                return nullptr;
+            }
+        }
+
+        auto mesh = std::make_shared<TriMesh>(std::move(vertices), std::move(triangles));
+
+        try {
+            mesh->restore_bvh(std::move(nodes), this->m_options);
+        } catch (std::runtime_error&) {
+            return nullptr;
+        }
+
+        return mesh;
+    }
+
+    void MeshCache::write_entry(
+        const boost::filesystem::path& path,
+        uint64_t key,
+        const TriMesh& mesh
+    ) const {
+        MeshCacheHeader header;
+
+        std::memcpy(header.magic, mesh_cache_magic, sizeof(header.magic));
+        header.key = key;
+        header.num_vertices = mesh.vertices().size();
+        header.num_triangles = mesh.triangles().size();
+        header.num_nodes = mesh.bvh().nodes().size();
+
+        // Write to a temporary file first so that other processes never see a partial entry. The
+        // name is randomized since several threads or processes may be writing the same entry.
+        boost::filesystem::path tmp_path;
+
+        try {
+            boost::filesystem::create_directories(this->m_dir);
+
+            tmp_path = path;
+            tmp_path += boost::filesystem::unique_path(".%%%%%%%%.tmp");
+
+            {
+                boost::filesystem::ofstream f(tmp_path, std::ios::binary | std::ios::trunc);
+
+                f.write(reinterpret_cast<const char*>(&header), sizeof(header));
+                write_array(f, mesh.vertices());
+                write_array(f, mesh.triangles());
+                write_array(f, mesh.bvh().nodes());
+
+                if (!f) {
+                    throw std::runtime_error(([&]() {
+                        std::ostringstream ss;
+
+                        ss << "Error writing mesh cache file \"" << tmp_path.string() << "\"";
+
+                        return ss.str();
+                    })());
+                }
+            }
+
+            boost::filesystem::rename(tmp_path, path);
+        } catch (...) {
+            if (!tmp_path.empty()) {
+                boost::system::error_code ec;
+
+                boost::filesystem::remove(tmp_path, ec);
+            }
+
+            throw;
+        }
+    }
+
+    std::shared_ptr<TriMesh> MeshCache::load_mesh(const boost::filesystem::path& path) const {
+        boost::filesystem::ifstream f(path, std::ios::binary);
+
+        if (!f) {
+            throw std::runtime_error(([&]() {
+                std::ostringstream ss;
+
+                ss << "Failed to open object file \"" << path.string() << "\"";
+
+                return ss.str();
+            })());
+        }
+
+        Hasher hasher;
+        char buf[65536];
+
+        while (f.read(buf, sizeof(buf)) || f.gcount() > 0) {
+            hasher.add(buf, f.gcount());
+        }
+
+        if (f.bad()) {
+            throw std::runtime_error(([&]() {
+                std::ostringstream ss;
+
+                ss << "Error reading object file \"" << path.string() << "\"";
+
+                return ss.str();
+            })());
+        }
+
+        // The width and quantization of the tree don't matter here since wide nodes are always
+        // rebuilt from the binary ones
+        hasher
+            .add(mesh_cache_version)
+            .add(static_cast<int>(this->m_options.method))
+            .add(this->m_options.delta)
+            .add(this->m_options.max_leaf_size)
+            .add(this->m_options.split_budget);
+
+        auto key = hasher.hash();
+        auto entry = this->entry_path(key);
+        auto mesh = this->read_entry(entry, key);
+
+        if (!mesh) {
+            mesh = TriMesh::load_mesh(path);
+
+            std::lock_guard<std::mutex> lock(this->m_mutex);
+
+            this->m_misses.emplace(mesh, PendingEntry(entry, key));
+        }
+
+        return mesh;
+    }
+
+    void MeshCache::build_bvh(const std::shared_ptr<TriMesh>& mesh) const {
+        PendingEntry miss;
+
+        {
+            std::lock_guard<std::mutex> lock(this->m_mutex);
+            auto it = this->m_misses.find(mesh);
+
+            if (it == this->m_misses.end()) return;
+
+            miss = std::move(it->second);
+            this->m_misses.erase(it);
+        }
+
+        mesh->regen_bvh(this->m_options);
+
+        // The cache is only an optimization, so a full disk or a read-only cache directory
+        // shouldn't stop the scene from loading
+        try {
+            this->write_entry(miss.first, miss.second, *mesh);
+        } catch (std::exception& e) {
+            std::cerr << "Warning: Failed to write mesh cache entry \"" << miss.first.string()
+                << "\": " << e.what() << "\n";
+        }
+    }
+}
@@ -1,17 +1,155 @@
+#include <algorithm>
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <limits>
-#include <map>
 #include <sstream>
 #include <stdexcept>
 
-#include <boost/algorithm/string.hpp>
-#include <boost/filesystem/fstream.hpp>
+#include <boost/filesystem/operations.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 
 #include "object.hpp"
+#include "parallel.hpp"
+#include "simd.hpp"
 
 namespace hw4 {
+    void Object::classify_transform() {
+        const auto& m = this->m_transform;
+
+        this->m_transform_class = TransformClass::general;
+        this->m_translation = glm::vec3(m[3]);
+        this->m_scale = this->m_inv_scale = 1;
+        this->m_rotation = this->m_inv_rotation = glm::mat3(1);
+
+        if (m[0][3] != 0 || m[1][3] != 0 || m[2][3] != 0 || m[3][3] != 1) return;
+
+        glm::mat3 linear(m);
+        float scale = glm::length(linear[0]);
+
+        if (!(scale > 0) || !std::isfinite(scale)) return;
+
+        // Allow for some rounding error in the rotations built from the scene file
+        const float tolerance = 1e-5f;
+
+        for (int i = 0; i < 3; i++) {
+            if (std::abs(glm::length(linear[i]) - scale) > tolerance * scale) return;
+
+            for (int j = i + 1; j < 3; j++) {
+                if (std::abs(glm::dot(linear[i], linear[j])) > tolerance * scale * scale) return;
+            }
+        }
+
+        this->m_scale = scale;
+        this->m_inv_scale = 1 / scale;
+
+        bool rotated = linear[0] != glm::vec3(scale, 0, 0)
+            || linear[1] != glm::vec3(0, scale, 0)
+            || linear[2] != glm::vec3(0, 0, scale);
+
+        if (!rotated) {
+            if (scale != 1) {
+                this->m_transform_class = TransformClass::uniform_scale;
+            } else if (this->m_translation != glm::vec3(0)) {
+                this->m_transform_class = TransformClass::translation;
+            } else {
+                this->m_transform_class = TransformClass::identity;
+            }
+        } else {
+            this->m_transform_class = TransformClass::similarity;
+
+            for (int i = 0; i < 3; i++) {
+                this->m_rotation[i] = linear[i] * this->m_inv_scale;
+            }
+
+            this->m_inv_rotation = glm::transpose(this->m_rotation);
+        }
+    }
+
+    Ray Object::to_object_space(const Ray& r, float& dist_mult) const {
+        switch (this->m_transform_class) {
+            case TransformClass::identity:
+                dist_mult = 1;
+                return r;
+            case TransformClass::translation:
+                dist_mult = 1;
+                return r.with_origin(r.origin() - this->m_translation);
+            case TransformClass::uniform_scale:
+                dist_mult = this->m_scale;
+                return r.with_origin((r.origin() - this->m_translation) * this->m_inv_scale);
+            case TransformClass::similarity:
+                dist_mult = this->m_scale;
+                return Ray(
+                    this->m_inv_rotation * ((r.origin() - this->m_translation) * this->m_inv_scale),
+                    this->m_inv_rotation * r.direction()
+                );
+            case TransformClass::general:
+                break;
+        }
+
+        return r.transform(this->m_inv_transform, dist_mult);
+    }
+
+    Intersection Object::to_world_space(const Intersection& i, float dist_mult) const {
+        switch (this->m_transform_class) {
+            case TransformClass::identity:
+                return i;
+            case TransformClass::translation:
+                return i.relocate(i.point() + this->m_translation, i.normal(), dist_mult);
+            case TransformClass::uniform_scale:
+                return i.relocate(
+                    i.point() * this->m_scale + this->m_translation,
+                    i.normal(),
+                    dist_mult
+                );
+            case TransformClass::similarity:
+                return i.relocate(
+                    this->m_rotation * (i.point() * this->m_scale) + this->m_translation,
+                    this->m_rotation * i.normal(),
+                    dist_mult
+                );
+            case TransformClass::general:
+                break;
+        }
+
+        return i.transform(this->m_transform, dist_mult);
+    }
+
+    boost::optional<Hit> Object::find_world_hit(const Ray& r, float max_distance) const {
+        return this->find_world_hit_using(r, max_distance, [this](const Ray& obj_ray, float obj_distance) {
+            return this->find_hit(obj_ray, obj_distance);
+        });
+    }
+
+    Intersection Object::world_intersection(const Ray& r, const Hit& hit) const {
+        float dist_mult;
+        Ray obj_ray = this->to_object_space(r, dist_mult);
+
+        return this->to_world_space(this->intersection(obj_ray, hit), dist_mult);
+    }
+
+    bool Object::world_occludes(const Ray& r, float max_distance) const {
+        return this->world_occludes_using(r, max_distance, [this](const Ray& obj_ray, float obj_distance) {
+            return this->occludes(obj_ray, obj_distance);
+        });
+    }
+
+    void Object::find_hits(
+        const RayPacket& p,
+        float* max_distances,
+        boost::optional<Hit>* hits
+    ) const {
+        for (size_t i = 0; i < p.size(); i++) {
+            hits[i] = this->find_hit(p[i], max_distances[i]);
+
+            if (hits[i]) {
+                max_distances[i] = hits[i]->t;
+            }
+        }
+    }
+
     SphereObject::SphereObject(
         float radius,
         glm::vec3 center,
@@ -23,313 +161,1027 @@ namespace hw4 {
             material
         ) {}
 
-    boost::optional<Intersection> SphereObject::find_intersection(const Ray& r) const {
-        float b = glm::dot(2.0f * r.direction(), r.origin());
-        float c = glm::dot(r.origin(), r.origin()) - 1;
+    static glm::vec2 sphere_texcoord(glm::vec3 p) {
+        return glm::vec2(
+            0.5 + std::atan2(p.z, p.x) / tau,
+            0.5 + std::asin(p.y) * 2 / tau
+        );
+    }
+
+    boost::optional<Hit> SphereObject::find_hit(const Ray& r, float max_distance) const {
+        float t;
+
+        if (!intersect_sphere(r, glm::vec3(0), 1, t) || t > max_distance) return boost::none;
+
+        return Hit { t, 1, 0, 0, 0 };
+    }
 
-        float qterm = b * b - 4 * c;
+    Intersection SphereObject::intersection(const Ray& r, const Hit& hit) const {
+        auto p = r.origin() + hit.t * r.direction();
 
-        if (qterm < 0)
+        // Rounding errors in t can leave p noticeably off the surface for distant hits, so the
+        // normal has to be normalized for reflected rays to keep unit length
+        return Intersection(p, glm::normalize(p), sphere_texcoord(p), this->material().get(), hit.t);
+    }
+
+    bool SphereObject::occludes(const Ray& r, float max_distance) const {
+        float t;
+
+        return intersect_sphere(r, glm::vec3(0), 1, t) && t <= max_distance;
+    }
+
+    boost::optional<Hit> SphereObject::find_world_hit(const Ray& r, float max_distance) const {
+        if (!this->in_world_space()) {
+            return this->Object::find_world_hit(r, max_distance);
+        }
+
+        float t;
+
+        if (!intersect_sphere(r, this->translation(), this->scale(), t) || t > max_distance) {
             return boost::none;
+        }
 
-        float t = -(b + std::sqrt(qterm)) / 2;
+        return Hit { t, 1, 0, 0, 0 };
+    }
+
+    Intersection SphereObject::world_intersection(const Ray& r, const Hit& hit) const {
+        if (!this->in_world_space()) {
+            return this->Object::world_intersection(r, hit);
+        }
+
+        auto p = r.origin() + hit.t * r.direction();
+        auto normal = glm::normalize(p - this->translation());
+
+        // The texture coordinates still come from the point on the untransformed unit sphere
+        auto obj_point = this->transform_class() == TransformClass::similarity
+            ? glm::transpose(this->rotation()) * normal
+            : normal;
 
-        if (t <= 0) {
-            t = -(b - std::sqrt(qterm)) / 2;
+        return Intersection(p, normal, sphere_texcoord(obj_point), this->material().get(), hit.t);
+    }
 
-            if (t <= 0) return boost::none;
+    bool SphereObject::world_occludes(const Ray& r, float max_distance) const {
+        if (!this->in_world_space()) {
+            return this->Object::world_occludes(r, max_distance);
         }
 
-        auto p = r.origin() + t * r.direction();
+        float t;
 
-        return Intersection(
-            p,
-            p,
-            glm::vec2(
-                0.5 + std::atan2(p.z, p.x) / tau,
-                0.5 + std::asin(p.y) * 2 / tau
-            ),
-            this->material().get(),
-            t
-        );
+        return intersect_sphere(r, this->translation(), this->scale(), t) && t <= max_distance;
     }
 
-    boost::optional<Intersection> TriMesh::find_intersection(const Ray& r, const Triangle& tri) const {
-        const auto& a = this->m_vertices[tri.a];
-        const auto& b = this->m_vertices[tri.b];
-        const auto& c = this->m_vertices[tri.c];
+    TriangleEdges::TriangleEdges(
+        const std::vector<Vertex>& vertices,
+        const std::vector<Triangle>& triangles
+    ) {
+        for (int axis = 0; axis < 3; axis++) {
+            this->m_a[axis].reserve(triangles.size() + padding);
+            this->m_ab[axis].reserve(triangles.size() + padding);
+            this->m_ac[axis].reserve(triangles.size() + padding);
+        }
+
+        for (const auto& t : triangles) {
+            const auto& a = vertices[t.a].pos;
+            auto ab = vertices[t.b].pos - a;
+            auto ac = vertices[t.c].pos - a;
 
-        // Use the Möller-Trumbore algorithm for intersection
-        auto ab = b.pos - a.pos;
-        auto ac = c.pos - a.pos;
+            for (int axis = 0; axis < 3; axis++) {
+                this->m_a[axis].push_back(a[axis]);
+                this->m_ab[axis].push_back(ab[axis]);
+                this->m_ac[axis].push_back(ac[axis]);
+            }
+        }
+
+        this->m_size = triangles.size();
+
+        for (int axis = 0; axis < 3; axis++) {
+            this->m_a[axis].resize(this->m_size + padding, 0);
+            this->m_ab[axis].resize(this->m_size + padding, 0);
+            this->m_ac[axis].resize(this->m_size + padding, 0);
+        }
+    }
 
+#if defined(HW4_SCALAR_TRIANGLES)
+    // Uses the Möller-Trumbore algorithm to find the distance along the given ray at which it hits
+    // the triangle with vertex a and edges ab and ac, along with the barycentric coordinates (u, v)
+    // of the hit.
+    static bool intersect_triangle(
+        const Ray& r,
+        const glm::vec3& a,
+        const glm::vec3& ab,
+        const glm::vec3& ac,
+        float& t,
+        float& u,
+        float& v
+    ) {
         auto pvec = glm::cross(r.direction(), ac);
         float det = glm::dot(ab, pvec);
 
         // If det is close to zero, then the ray is parallel to the triangle, so we can bail early.
-        if (std::fabs(det) <= 1e-7f) return boost::none;
+        if (std::fabs(det) <= 1e-7f) return false;
 
         float inv_det = 1.0 / det;
 
-        auto tvec = r.origin() - a.pos;
-        float u = glm::dot(tvec, pvec) * inv_det;
+        auto tvec = r.origin() - a;
+        u = glm::dot(tvec, pvec) * inv_det;
 
-        if (u < 0 || u > 1) return boost::none;
+        if (u < 0 || u > 1) return false;
 
         auto qvec = glm::cross(tvec, ab);
-        float v = glm::dot(r.direction(), qvec) * inv_det;
+        v = glm::dot(r.direction(), qvec) * inv_det;
 
-        if (v < 0 || u + v > 1) return boost::none;
+        if (v < 0 || u + v > 1) return false;
 
-        float t = glm::dot(ac, qvec) * inv_det;
+        t = glm::dot(ac, qvec) * inv_det;
 
-        if (t < 0) return boost::none;
+        return t >= 0;
+    }
+#else
+    typedef simd::float_native TriangleVec;
+
+    static_assert(TriangleVec::width <= TriangleEdges::padding, "Not enough padding for SIMD loads");
+
+    // Runs the same test as intersect_triangle on the TriangleVec::width triangles starting at
+    // first, returning a bitmask of the triangles which the ray hits. The distances and
+    // barycentric coordinates of the hits are stored in t, u and v.
+    static unsigned int intersect_triangles(
+        const Ray& r,
+        const TriangleEdges& edges,
+        size_t first,
+        float* t,
+        float* u,
+        float* v
+    ) {
+        TriangleVec ox(r.origin().x), oy(r.origin().y), oz(r.origin().z);
+        TriangleVec dx(r.direction().x), dy(r.direction().y), dz(r.direction().z);
+
+        auto abx = TriangleVec::load(edges.ab(0) + first);
+        auto aby = TriangleVec::load(edges.ab(1) + first);
+        auto abz = TriangleVec::load(edges.ab(2) + first);
+        auto acx = TriangleVec::load(edges.ac(0) + first);
+        auto acy = TriangleVec::load(edges.ac(1) + first);
+        auto acz = TriangleVec::load(edges.ac(2) + first);
+
+        // This follows the same steps as intersect_triangle, but the reciprocal of the determinant
+        // is taken in single rather than double precision, so the results are only equivalent
+        // within float rounding
+        auto px = dy * acz - acy * dz;
+        auto py = dz * acx - acz * dx;
+        auto pz = dx * acy - acx * dy;
+        auto det = abx * px + aby * py + abz * pz;
+
+        unsigned int miss = less_equal(det, TriangleVec(1e-7f)) & less_equal(TriangleVec(-1e-7f), det);
+
+        auto inv_det = TriangleVec(1) / det;
+
+        auto tx = ox - TriangleVec::load(edges.a(0) + first);
+        auto ty = oy - TriangleVec::load(edges.a(1) + first);
+        auto tz = oz - TriangleVec::load(edges.a(2) + first);
+        auto uv = (tx * px + ty * py + tz * pz) * inv_det;
+
+        auto qx = ty * abz - aby * tz;
+        auto qy = tz * abx - abz * tx;
+        auto qz = tx * aby - abx * ty;
+        auto vv = (dx * qx + dy * qy + dz * qz) * inv_det;
+        auto tv = (acx * qx + acy * qy + acz * qz) * inv_det;
+
+        miss |= less(uv, TriangleVec(0)) | less(TriangleVec(1), uv);
+        miss |= less(vv, TriangleVec(0)) | less(TriangleVec(1), uv + vv);
+        miss |= less(tv, TriangleVec(0));
+
+        uv.store(u);
+        vv.store(v);
+        tv.store(t);
+
+        return ~miss & ((1u << TriangleVec::width) - 1);
+    }
+#endif
+
+    Intersection TriMesh::intersection(const Ray& r, const Hit& hit) const {
+        const auto& tri = this->m_triangles[hit.primitive];
+        const auto& a = this->m_vertices[tri.a];
+        const auto& b = this->m_vertices[tri.b];
+        const auto& c = this->m_vertices[tri.c];
+        float u = hit.u;
+        float v = hit.v;
 
         // Now that we know an intersection occurs, we need to use u and v to perform barycentric
         // interpolation to find the correct attribute values
         return Intersection(
-            r.origin() + t * r.direction(),
+            r.origin() + hit.t * r.direction(),
             glm::normalize((1 - u - v) * a.normal + u * b.normal + v * c.normal),
             (1 - u - v) * a.texcoord + u * b.texcoord + v * c.texcoord,
             nullptr,
-            t
+            hit.t
         );
     }
 
-    boost::optional<Intersection> TriMesh::find_intersection(const Ray& r) const {
-        float depth = std::numeric_limits<float>::infinity();
-        boost::optional<Intersection> intersection;
+    bool TriMesh::intersect_leaf(
+        const Ray& r,
+        uint32_t first,
+        uint32_t count,
+        float max_distance,
+        Hit& hit
+    ) const {
+        bool found = false;
+
+#if defined(HW4_SCALAR_TRIANGLES)
+        for (uint32_t i = first; i < first + count; i++) {
+            glm::vec3 a, ab, ac;
+            float t, u, v;
+
+            this->m_edges.get(i, a, ab, ac);
+
+            if (intersect_triangle(r, a, ab, ac, t, u, v) && t < max_distance) {
+                max_distance = t;
+                hit = Hit { t, 1, i, u, v };
+                found = true;
+            }
+        }
+#else
+        float t[TriangleVec::width], u[TriangleVec::width], v[TriangleVec::width];
+
+        for (uint32_t i = first; i < first + count; i += TriangleVec::width) {
+            unsigned int mask = intersect_triangles(r, this->m_edges, i, t, u, v);
+
+            if (first + count - i < TriangleVec::width) {
+                mask &= (1u << (first + count - i)) - 1;
+            }
+
+            // Take the first of the nearest hits, as testing the triangles one at a time would
+            for (; mask != 0; mask &= mask - 1) {
+                int k = __builtin_ctz(mask);
+
+                if (t[k] < max_distance) {
+                    max_distance = t[k];
+                    hit = Hit { t[k], 1, i + k, u[k], v[k] };
+                    found = true;
+                }
+            }
+        }
+#endif
+
+        return found;
+    }
+
+    bool TriMesh::occludes_leaf(
+        const Ray& r,
+        uint32_t first,
+        uint32_t count,
+        float max_distance
+    ) const {
+#if defined(HW4_SCALAR_TRIANGLES)
+        for (uint32_t i = first; i < first + count; i++) {
+            glm::vec3 a, ab, ac;
+            float t, u, v;
+
+            this->m_edges.get(i, a, ab, ac);
+
+            if (intersect_triangle(r, a, ab, ac, t, u, v) && t <= max_distance) return true;
+        }
+#else
+        float t[TriangleVec::width], u[TriangleVec::width], v[TriangleVec::width];
+
+        for (uint32_t i = first; i < first + count; i += TriangleVec::width) {
+            unsigned int mask = intersect_triangles(r, this->m_edges, i, t, u, v);
+
+            if (first + count - i < TriangleVec::width) {
+                mask &= (1u << (first + count - i)) - 1;
+            }
+
+            for (; mask != 0; mask &= mask - 1) {
+                if (t[__builtin_ctz(mask)] <= max_distance) return true;
+            }
+        }
+#endif
+
+        return false;
+    }
+
+    boost::optional<Hit> TriMesh::find_hit(const Ray& r, float max_distance) const {
+        float depth = max_distance;
+        boost::optional<Hit> closest;
 
-        this->m_bvh.search(r, [&](auto& t) {
-            auto new_intersection = this->find_intersection(r, t);
+        this->m_bvh.search_closest_leaves(r, depth, [&](uint32_t first, uint32_t count) {
+            Hit hit;
 
-            if (new_intersection && new_intersection->distance() < depth) {
-                depth = new_intersection->distance();
-                intersection = new_intersection;
+            if (this->intersect_leaf(r, first, count, depth, hit)) {
+                depth = hit.t;
+                closest = hit;
             }
         });
 
-        return intersection;
+        return closest;
     }
 
-    class TriMeshLoader {
-        std::vector<Vertex> m_vertices;
-        std::vector<Triangle> m_triangles;
+    void TriMesh::find_hits(
+        const RayPacket& p,
+        float* max_distances,
+        boost::optional<Hit>* hits
+    ) const {
+        std::fill(hits, hits + p.size(), boost::none);
 
-        std::map<std::tuple<unsigned int, unsigned int, unsigned int>, unsigned int> m_vertex_indices;
+        this->m_bvh.search_closest_packet_leaves(p, max_distances, [&](uint32_t first, uint32_t count, uint64_t mask) {
+            for (size_t i = 0; i < p.size(); i++) {
+                if ((mask & (static_cast<uint64_t>(1) << i)) == 0) continue;
 
-        std::vector<glm::vec3> m_pos;
-        std::vector<glm::vec2> m_tex;
-        std::vector<glm::vec3> m_norm;
+                Hit hit;
 
-        unsigned int add_vertex(unsigned int pos, unsigned int tex, unsigned int norm);
-        unsigned int add_vertex(std::string spec);
-    public:
-        TriMeshLoader() {}
-        TriMeshLoader(const TriMeshLoader& other) = delete;
+                if (this->intersect_leaf(p[i], first, count, max_distances[i], hit)) {
+                    max_distances[i] = hit.t;
+                    hits[i] = hit;
+                }
+            }
+        });
+    }
 
-        TriMeshLoader& operator =(const TriMeshLoader& other) = delete;
+    bool TriMesh::occludes(const Ray& r, float max_distance) const {
+        return this->m_bvh.search_any_leaves(r, max_distance, [&](uint32_t first, uint32_t count) {
+            return this->occludes_leaf(r, first, count, max_distance);
+        });
+    }
 
-        void handle_line(std::string line);
-        std::shared_ptr<TriMesh> finish();
-    };
+    BoundingBox TriMesh::calc_triangle_clipped_bounding_box(
+        const Triangle& t,
+        const BoundingBox& box
+    ) const {
+        // Clip the triangle against each plane of the box in turn (Sutherland-Hodgman), which
+        // leaves a convex polygon with at most 9 vertices
+        glm::vec3 polygon[9] = {
+            this->m_vertices[t.a].pos,
+            this->m_vertices[t.b].pos,
+            this->m_vertices[t.c].pos
+        };
+        size_t size = 3;
+
+        for (int axis = 0; axis < 3 && size > 0; axis++) {
+            for (int side = 0; side < 2 && size > 0; side++) {
+                float plane = side == 0 ? box.min()[axis] : box.max()[axis];
+                auto inside = [&](const glm::vec3& v) {
+                    return side == 0 ? v[axis] >= plane : v[axis] <= plane;
+                };
+
+                glm::vec3 clipped[9];
+                size_t clipped_size = 0;
+
+                for (size_t i = 0; i < size; i++) {
+                    const auto& a = polygon[i];
+                    const auto& b = polygon[(i + 1) % size];
+
+                    if (inside(a)) clipped[clipped_size++] = a;
+
+                    if (inside(a) != inside(b)) {
+                        auto v = a + (b - a) * ((plane - a[axis]) / (b[axis] - a[axis]));
+
+                        // Make sure that rounding doesn't leave the new vertex off the plane
+                        v[axis] = plane;
+                        clipped[clipped_size++] = v;
+                    }
+                }
+
+                std::copy(clipped, clipped + clipped_size, polygon);
+                size = clipped_size;
+            }
+        }
 
-    unsigned int TriMeshLoader::add_vertex(unsigned int pos, unsigned int tex, unsigned int norm) {
-        auto t = std::make_tuple(pos, tex, norm);
-        auto existing_entry = this->m_vertex_indices.find(t);
+        auto result = BoundingBox::empty();
 
-        if (existing_entry != this->m_vertex_indices.end()) {
-            return existing_entry->second;
+        for (size_t i = 0; i < size; i++) {
+            result = BoundingBox::combine(result, BoundingBox(polygon[i], polygon[i]));
         }
 
-        if (pos >= this->m_pos.size() || tex >= this->m_tex.size() || norm >= this->m_norm.size()) {
-            throw std::runtime_error("Face vertex index out of range");
+        // Rounding in the intersection calculations could otherwise push the box slightly outside
+        return BoundingBox::intersection(result, box);
+    }
+
+    // A range of characters within a memory-mapped file
+    struct ObjToken {
+        const char* begin;
+        const char* end;
+
+        size_t size() const { return static_cast<size_t>(this->end - this->begin); }
+
+        bool operator ==(const char* s) const {
+            size_t len = std::strlen(s);
+
+            return this->size() == len && std::memcmp(this->begin, s, len) == 0;
         }
 
-        this->m_vertices.push_back(Vertex {
-            .pos = this->m_pos[pos],
-            .normal = this->m_norm[norm],
-            .texcoord = this->m_tex[tex]
-        });
-        this->m_vertex_indices.emplace(t, this->m_vertices.size() - 1);
+        std::string str() const { return std::string(this->begin, this->end); }
+    };
 
-        return this->m_vertices.size() - 1;
+    static bool is_obj_space(char c) {
+        return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
     }
 
-    unsigned int TriMeshLoader::add_vertex(std::string spec) {
-        std::vector<std::string> parts;
+    // Finds the next whitespace-separated token in [p, end), advancing p past it
+    static bool next_obj_token(const char*& p, const char* end, ObjToken& token) {
+        while (p != end && is_obj_space(*p)) p++;
 
-        boost::split(parts, spec, boost::is_any_of("/"));
+        if (p == end) return false;
 
-        if (parts.size() != 3) {
-            throw std::runtime_error(([&]() {
-                std::ostringstream ss;
+        token.begin = p;
 
-                ss << "Invalid face vertex specification \"" << spec << "\"";
+        while (p != end && !is_obj_space(*p)) p++;
 
-                return ss.str();
-            })());
+        token.end = p;
+        return true;
+    }
+
+    static const char* strip_obj_comment(const char* begin, const char* end) {
+        auto comment = static_cast<const char*>(std::memchr(begin, '#', end - begin));
+
+        return comment ? comment : end;
+    }
+
+    static bool is_digit(char c) {
+        return c >= '0' && c <= '9';
+    }
+
+    static std::runtime_error invalid_number(const ObjToken& t) {
+        std::ostringstream ss;
+
+        ss << "Invalid number \"" << t.str() << "\"";
+
+        return std::runtime_error(ss.str());
+    }
+
+    // Parses a decimal number without going through the C library, which would need a
+    // null-terminated copy of the token and has to consult the locale. When the digits fit in 24
+    // bits and the exponent is at most 10 in magnitude, both operands are exact as floats, so a
+    // single correctly rounded division or multiplication by a power of ten gives the same result
+    // as std::strtof. That covers everything exporters normally write, and anything else falls
+    // back to std::strtof.
+    static float parse_float(const ObjToken& t) {
+        static const float float_pow10[] = {
+            1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f
+        };
+
+        const char* p = t.begin;
+        bool negative = false;
+
+        if (p != t.end && (*p == '-' || *p == '+')) {
+            negative = *p == '-';
+            p++;
         }
 
-        int pos = std::stoi(parts[0]);
-        if (pos < 0) {
-            pos += this->m_pos.size() + 1;
+        uint64_t mantissa = 0;
+        int digits = 0;
+        int significant_digits = 0;
+        int exponent = 0;
 
-            if (pos <= 0) {
-                throw std::out_of_range("Negative index out of range");
+        for (; p != t.end && is_digit(*p); p++, digits++) {
+            if (mantissa != 0 || *p != '0') {
+                mantissa = mantissa * 10 + (*p - '0');
+                significant_digits++;
             }
-        } else if (pos == 0) {
-            throw std::out_of_range("0 is not a valid index");
         }
 
-        int tex = std::stoi(parts[1]);
-        if (tex < 0) {
-            tex += this->m_tex.size() + 1;
+        if (p != t.end && *p == '.') {
+            for (p++; p != t.end && is_digit(*p); p++, digits++) {
+                if (mantissa != 0 || *p != '0') {
+                    mantissa = mantissa * 10 + (*p - '0');
+                    significant_digits++;
+                }
 
-            if (tex <= 0) {
-                throw std::out_of_range("Negative index out of range");
+                exponent--;
+            }
+        }
+
+        if (digits == 0) throw invalid_number(t);
+
+        if (p != t.end && (*p == 'e' || *p == 'E')) {
+            bool negative_exponent = false;
+            int e = 0;
+
+            p++;
+
+            if (p != t.end && (*p == '-' || *p == '+')) {
+                negative_exponent = *p == '-';
+                p++;
+            }
+
+            if (p == t.end || !is_digit(*p)) throw invalid_number(t);
+
+            for (; p != t.end && is_digit(*p); p++) {
+                if (e < 10000) e = e * 10 + (*p - '0');
+            }
+
+            exponent += negative_exponent ? -e : e;
+        }
+
+        if (p != t.end) throw invalid_number(t);
+
+        float result;
+
+        if (mantissa == 0) {
+            result = 0;
+        } else if (significant_digits > 19) {
+            // The mantissa may have overflowed, so let the C library deal with it
+            result = std::strtof(t.str().c_str(), nullptr);
+            negative = false;
+        } else if (mantissa <= (1u << 24) && exponent >= -10 && exponent <= 10) {
+            // Both operands are exact as floats, so the result is correctly rounded
+            result = exponent < 0
+                ? static_cast<float>(mantissa) / float_pow10[-exponent]
+                : static_cast<float>(mantissa) * float_pow10[exponent];
+        } else {
+            result = std::strtof(t.str().c_str(), nullptr);
+            negative = false;
+        }
+
+        return negative ? -result : result;
+    }
+
+    static int parse_int(const ObjToken& t) {
+        const char* p = t.begin;
+        bool negative = false;
+
+        if (p != t.end && (*p == '-' || *p == '+')) {
+            negative = *p == '-';
+            p++;
+        }
+
+        if (p == t.end) throw invalid_number(t);
+
+        int64_t value = 0;
+
+        for (; p != t.end; p++) {
+            if (!is_digit(*p)) throw invalid_number(t);
+
+            value = value * 10 + (*p - '0');
+
+            if (value > std::numeric_limits<int>::max()) {
+                throw std::out_of_range("Index out of range");
             }
-        } else if (tex == 0) {
-            throw std::out_of_range("0 is not a valid index");
         }
 
-        int norm = std::stoi(parts[2]);
-        if (norm < 0) {
-            norm += this->m_norm.size() + 1;
+        return static_cast<int>(negative ? -value : value);
+    }
+
+    // Converts a 1-based OBJ index, which may be negative to count back from the most recent
+    // element, into a 0-based index given the number of elements defined so far
+    static unsigned int resolve_index(int index, size_t count) {
+        if (index < 0) {
+            int64_t resolved = static_cast<int64_t>(index) + static_cast<int64_t>(count) + 1;
 
-            if (norm <= 0) {
+            if (resolved <= 0) {
                 throw std::out_of_range("Negative index out of range");
             }
-        } else if (norm == 0) {
+
+            return static_cast<unsigned int>(resolved - 1);
+        } else if (index == 0) {
             throw std::out_of_range("0 is not a valid index");
+        } else if (static_cast<size_t>(index) > count) {
+            throw std::out_of_range("Face vertex index out of range");
         }
 
-        return this->add_vertex(
-            static_cast<unsigned int>(pos - 1),
-            static_cast<unsigned int>(tex - 1),
-            static_cast<unsigned int>(norm - 1)
-        );
+        return static_cast<unsigned int>(index - 1);
     }
 
-    static glm::vec3 parse_vec3(const std::vector<std::string>& parts, int start) {
-        return glm::vec3(
-            std::stof(parts[start]),
-            std::stof(parts[start + 1]),
-            std::stof(parts[start + 2])
+    // Loads a mesh from the contents of an OBJ file. Large files are split into chunks of whole
+    // lines which are parsed in parallel. A quick first pass counts the lines and elements in each
+    // chunk, so that every chunk knows where its positions, texture coordinates, and normals go in
+    // the final arrays and can resolve relative indices itself. The faces of each chunk are then
+    // merged in file order, deduplicating their vertices.
+    class TriMeshLoader {
+        // Chunks smaller than this aren't worth handing to another thread
+        static constexpr size_t min_chunk_size = 1 << 18;
+
+        struct FaceVertex {
+            unsigned int pos;
+            unsigned int tex;
+            unsigned int norm;
+        };
+
+        // An open-addressing hash table with linear probing which maps face vertices to the
+        // indices of the mesh vertices created for them. Each slot holds a face vertex along with
+        // its mesh vertex index in 16 bytes, so a lookup usually touches a single cache line.
+        class VertexTable {
+            struct Slot {
+                FaceVertex key;
+                unsigned int index;
+            };
+
+            static constexpr unsigned int empty = std::numeric_limits<unsigned int>::max();
+
+            std::vector<Slot> m_slots;
+            size_t m_size = 0;
+
+            static size_t hash(const FaceVertex& v) {
+                uint64_t h = (static_cast<uint64_t>(v.pos) | static_cast<uint64_t>(v.tex) << 32)
+                    * 0x9e3779b97f4a7c15;
+
+                h ^= static_cast<uint64_t>(v.norm) * 0xc2b2ae3d27d4eb4f;
+
+                return static_cast<size_t>(h ^ (h >> 29));
+            }
+
+            void grow() {
+                auto old_slots = std::move(this->m_slots);
+
+                this->m_slots.assign(old_slots.size() * 2, Slot { FaceVertex {}, empty });
+
+                // The keys are already known to be distinct, so each one just goes in the first
+                // free slot of its probe sequence, without being counted again
+                size_t mask = this->m_slots.size() - 1;
+
+                for (const auto& s : old_slots) {
+                    if (s.index == empty) continue;
+
+                    size_t i = hash(s.key) & mask;
+
+                    while (this->m_slots[i].index != empty) i = (i + 1) & mask;
+
+                    this->m_slots[i] = s;
+                }
+            }
+        public:
+            // The table starts out big enough to hold the given number of vertices without
+            // having to grow
+            explicit VertexTable(size_t expected_size) {
+                size_t capacity = 16;
+
+                while (capacity < expected_size * 2) capacity *= 2;
+
+                this->m_slots.assign(capacity, Slot { FaceVertex {}, empty });
+            }
+
+            // Returns the index already associated with the given face vertex, or associates it
+            // with the given index and returns that if it wasn't already in the table
+            unsigned int insert(const FaceVertex& v, unsigned int index) {
+                size_t mask = this->m_slots.size() - 1;
+
+                for (size_t i = hash(v) & mask; ; i = (i + 1) & mask) {
+                    auto& s = this->m_slots[i];
+
+                    if (s.index == empty) {
+                        s = Slot { v, index };
+
+                        // Keep the load factor at most 1/2 so that probe sequences stay short
+                        if (++this->m_size * 2 > this->m_slots.size()) this->grow();
+
+                        return index;
+                    }
+
+                    if (s.key.pos == v.pos && s.key.tex == v.tex && s.key.norm == v.norm) {
+                        return s.index;
+                    }
+                }
+            }
+        };
+
+        struct Chunk {
+            const char* begin = nullptr;
+            const char* end = nullptr;
+
+            size_t num_lines = 0;
+            size_t num_pos = 0;
+            size_t num_tex = 0;
+            size_t num_norm = 0;
+
+            // The number of lines and elements before this chunk. While the chunk is parsed, the
+            // bases advance to count the elements before the current line, which is also where the
+            // next element of each type gets stored.
+            size_t first_line = 0;
+            size_t pos_base = 0;
+            size_t tex_base = 0;
+            size_t norm_base = 0;
+
+            std::vector<FaceVertex> faces;
+
+            // The first error encountered in this chunk, if any
+            size_t error_line = 0;
+            std::string error;
+        };
+
+        boost::filesystem::path m_path;
+        const char* m_data;
+        size_t m_size;
+
+        std::vector<Chunk> m_chunks;
+
+        std::vector<Vertex> m_vertices;
+        std::vector<Triangle> m_triangles;
+
+        std::vector<glm::vec3> m_pos;
+        std::vector<glm::vec2> m_tex;
+        std::vector<glm::vec3> m_norm;
+
+        const char* align_to_line(size_t offset) const;
+
+        void count_chunk(Chunk& c) const;
+        void parse_chunk(Chunk& c);
+        void handle_line(Chunk& c, const char* begin, const char* end);
+        FaceVertex parse_face_vertex(const Chunk& c, const ObjToken& spec) const;
+
+        unsigned int add_vertex(VertexTable& table, const FaceVertex& v);
+    public:
+        TriMeshLoader(boost::filesystem::path path, const char* data, size_t size)
+            : m_path(std::move(path)), m_data(data), m_size(size) {}
+        TriMeshLoader(const TriMeshLoader& other) = delete;
+
+        TriMeshLoader& operator =(const TriMeshLoader& other) = delete;
+
+        std::shared_ptr<TriMesh> load();
+    };
+
+    // Returns the start of the first line which begins at or after the given offset
+    const char* TriMeshLoader::align_to_line(size_t offset) const {
+        if (offset == 0 || offset >= this->m_size) {
+            return this->m_data + std::min(offset, this->m_size);
+        }
+
+        const char* prev = this->m_data + offset - 1;
+        auto newline = static_cast<const char*>(
+            std::memchr(prev, '\n', this->m_data + this->m_size - prev)
         );
+
+        return newline ? newline + 1 : this->m_data + this->m_size;
     }
 
-    static glm::vec2 parse_vec2(const std::vector<std::string>& parts, int start) {
-        return glm::vec2(
-            std::stof(parts[start]),
-            std::stof(parts[start + 1])
-        );
+    void TriMeshLoader::count_chunk(Chunk& c) const {
+        for (const char* p = c.begin; p != c.end; ) {
+            auto newline = static_cast<const char*>(std::memchr(p, '\n', c.end - p));
+            const char* line_end = newline ? newline : c.end;
+            const char* line_p = p;
+            ObjToken keyword;
+
+            c.num_lines++;
+
+            if (next_obj_token(line_p, strip_obj_comment(p, line_end), keyword)) {
+                if (keyword == "v") {
+                    c.num_pos++;
+                } else if (keyword == "vt") {
+                    c.num_tex++;
+                } else if (keyword == "vn") {
+                    c.num_norm++;
+                }
+            }
+
+            p = newline ? newline + 1 : c.end;
+        }
     }
 
-    void TriMeshLoader::handle_line(std::string line) {
-        size_t comment_pos = line.find("#");
+    void TriMeshLoader::parse_chunk(Chunk& c) {
+        size_t line_number = c.first_line;
+
+        try {
+            for (const char* p = c.begin; p != c.end; ) {
+                auto newline = static_cast<const char*>(std::memchr(p, '\n', c.end - p));
+                const char* line_end = newline ? newline : c.end;
 
-        if (comment_pos != std::string::npos) {
-            line = line.substr(0, comment_pos);
+                line_number++;
+                this->handle_line(c, p, line_end);
+
+                p = newline ? newline + 1 : c.end;
+            }
+        } catch (std::exception& e) {
+            c.error_line = line_number;
+            c.error = e.what();
         }
+    }
 
-        boost::trim(line);
+    TriMeshLoader::FaceVertex TriMeshLoader::parse_face_vertex(
+        const Chunk& c,
+        const ObjToken& spec
+    ) const {
+        const char* slashes[2];
+        size_t num_slashes = 0;
+
+        for (const char* p = spec.begin; p != spec.end; p++) {
+            if (*p == '/') {
+                if (num_slashes == 2) {
+                    num_slashes++;
+                    break;
+                }
+
+                slashes[num_slashes++] = p;
+            }
+        }
 
-        if (line.size() == 0) {
-            return;
+        if (num_slashes != 2) {
+            throw std::runtime_error(([&]() {
+                std::ostringstream ss;
+
+                ss << "Invalid face vertex specification \"" << spec.str() << "\"";
+
+                return ss.str();
+            })());
         }
 
-        std::vector<std::string> parts;
+        int pos = parse_int(ObjToken { spec.begin, slashes[0] });
+        int tex = parse_int(ObjToken { slashes[0] + 1, slashes[1] });
+        int norm = parse_int(ObjToken { slashes[1] + 1, spec.end });
+
+        return FaceVertex {
+            resolve_index(pos, c.pos_base),
+            resolve_index(tex, c.tex_base),
+            resolve_index(norm, c.norm_base)
+        };
+    }
+
+    void TriMeshLoader::handle_line(Chunk& c, const char* begin, const char* end) {
+        end = strip_obj_comment(begin, end);
+
+        // Only the first few tokens are kept, since no supported statement has more than that,
+        // but all of them are counted so that the number of arguments can still be checked
+        ObjToken parts[4];
+        ObjToken token;
+        size_t num_parts = 0;
 
-        boost::split(parts, line, boost::is_any_of(" \t"), boost::token_compress_on);
+        while (next_obj_token(begin, end, token)) {
+            if (num_parts < 4) parts[num_parts] = token;
+
+            num_parts++;
+        }
+
+        if (num_parts == 0) {
+            return;
+        }
 
         if (parts[0] == "v") {
-            if (parts.size() != 4) {
+            if (num_parts != 4) {
                 throw std::runtime_error("Wrong number of arguments for \"v\"");
             }
 
-            this->m_pos.push_back(parse_vec3(parts, 1));
+            this->m_pos[c.pos_base++] = glm::vec3(
+                parse_float(parts[1]),
+                parse_float(parts[2]),
+                parse_float(parts[3])
+            );
         } else if (parts[0] == "vt") {
-            if (parts.size() != 3) {
+            if (num_parts != 3) {
                 throw std::runtime_error("Wrong number of arguments for \"vt\"");
             }
 
-            auto v = parse_vec2(parts, 1);
+            float u = parse_float(parts[1]);
+            float v = parse_float(parts[2]);
 
-            this->m_tex.push_back(glm::vec2(v.x, 1 - v.y));
+            this->m_tex[c.tex_base++] = glm::vec2(u, 1 - v);
         } else if (parts[0] == "vn") {
-            if (parts.size() != 4) {
+            if (num_parts != 4) {
                 throw std::runtime_error("Wrong number of arguments for \"vn\"");
             }
 
-            this->m_norm.push_back(parse_vec3(parts, 1));
+            this->m_norm[c.norm_base++] = glm::vec3(
+                parse_float(parts[1]),
+                parse_float(parts[2]),
+                parse_float(parts[3])
+            );
         } else if (parts[0] == "f") {
-            if (parts.size() != 4) {
+            if (num_parts != 4) {
                 throw std::runtime_error("Wrong number of arguments for \"f\"");
             }
 
-            this->m_triangles.push_back(Triangle {
-                .a = this->add_vertex(parts[1]),
-                .b = this->add_vertex(parts[2]),
-                .c = this->add_vertex(parts[3])
-            });
+            c.faces.push_back(this->parse_face_vertex(c, parts[1]));
+            c.faces.push_back(this->parse_face_vertex(c, parts[2]));
+            c.faces.push_back(this->parse_face_vertex(c, parts[3]));
         }
     }
 
-    std::shared_ptr<TriMesh> TriMeshLoader::finish() {
-        auto mesh = std::make_shared<TriMesh>(
-            std::move(this->m_vertices),
-            std::move(this->m_triangles)
-        );
+    unsigned int TriMeshLoader::add_vertex(VertexTable& table, const FaceVertex& v) {
+        auto next_index = static_cast<unsigned int>(this->m_vertices.size());
+        auto index = table.insert(v, next_index);
 
-        this->m_vertex_indices.clear();
-        this->m_pos.clear();
-        this->m_tex.clear();
-        this->m_norm.clear();
+        if (index == next_index) {
+            this->m_vertices.push_back(Vertex {
+                .pos = this->m_pos[v.pos],
+                .normal = this->m_norm[v.norm],
+                .texcoord = this->m_tex[v.tex]
+            });
+        }
 
-        return mesh;
+        return index;
     }
 
-    std::shared_ptr<TriMesh> TriMesh::load_mesh(boost::filesystem::path path) {
-        boost::filesystem::ifstream f(path);
+    std::shared_ptr<TriMesh> TriMeshLoader::load() {
+        size_t num_chunks = chunk_count(this->m_size, min_chunk_size);
 
-        if (!f) {
-            throw std::runtime_error(([&]() {
-                std::ostringstream ss;
+        this->m_chunks.resize(num_chunks);
 
-                ss << "Failed to open object file \"" << path.string() << "\"";
+        parallel_for_chunks(this->m_size, num_chunks, [&](size_t i, size_t start, size_t end) {
+            auto& c = this->m_chunks[i];
 
-                return ss.str();
-            })());
+            c.begin = this->align_to_line(start);
+            c.end = this->align_to_line(end);
+
+            this->count_chunk(c);
+        });
+
+        size_t num_lines = 0;
+        size_t num_pos = 0;
+        size_t num_tex = 0;
+        size_t num_norm = 0;
+
+        for (auto& c : this->m_chunks) {
+            c.first_line = num_lines;
+            c.pos_base = num_pos;
+            c.tex_base = num_tex;
+            c.norm_base = num_norm;
+
+            num_lines += c.num_lines;
+            num_pos += c.num_pos;
+            num_tex += c.num_tex;
+            num_norm += c.num_norm;
         }
 
-        TriMeshLoader loader;
-        std::string line;
+        this->m_pos.resize(num_pos);
+        this->m_tex.resize(num_tex);
+        this->m_norm.resize(num_norm);
+
+        parallel_for_chunks(num_chunks, num_chunks, [&](size_t i, size_t, size_t) {
+            this->parse_chunk(this->m_chunks[i]);
+        });
 
-        while (std::getline(f, line)) {
-            loader.handle_line(line);
+        for (auto& c : this->m_chunks) {
+            if (!c.error.empty()) {
+                throw std::runtime_error(([&]() {
+                    std::ostringstream ss;
+
+                    ss << "Error on line " << c.error_line << " of object file \""
+                        << this->m_path.string() << "\": " << c.error;
+
+                    return ss.str();
+                })());
+            }
         }
 
-        if (f.bad()) {
+        size_t num_face_vertices = 0;
+
+        for (const auto& c : this->m_chunks) {
+            num_face_vertices += c.faces.size();
+        }
+
+        // In a typical closed mesh each vertex is shared by around six triangles, so sizing the
+        // table for a quarter of the face vertices avoids growing it without wasting much memory
+        // when there's less sharing than that
+        VertexTable table(num_face_vertices / 4);
+
+        this->m_triangles.reserve(num_face_vertices / 3);
+
+        for (auto& c : this->m_chunks) {
+            for (size_t i = 0; i < c.faces.size(); i += 3) {
+                this->m_triangles.push_back(Triangle {
+                    .a = this->add_vertex(table, c.faces[i]),
+                    .b = this->add_vertex(table, c.faces[i + 1]),
+                    .c = this->add_vertex(table, c.faces[i + 2])
+                });
+            }
+
+            c.faces = std::vector<FaceVertex>();
+        }
+
+        return std::make_shared<TriMesh>(
+            std::move(this->m_vertices),
+            std::move(this->m_triangles)
+        );
+    }
+
+    std::shared_ptr<TriMesh> TriMesh::load_mesh(boost::filesystem::path path) {
+        // Map the file rather than reading it through a stream so that it can be parsed in place
+        // without copying each line out. Empty files can't be mapped, but they're valid (if
+        // useless) meshes.
+        boost::iostreams::mapped_file_source file;
+
+        try {
+            if (!boost::filesystem::is_empty(path)) {
+                file.open(path.string());
+            }
+        } catch (std::exception&) {
             throw std::runtime_error(([&]() {
                 std::ostringstream ss;
 
-                ss << "Error reading object file \"" << path.string() << "\"";
+                ss << "Failed to open object file \"" << path.string() << "\"";
 
                 return ss.str();
             })());
         }
 
-        return loader.finish();
+        if (!file.is_open()) {
+            return TriMeshLoader(path, nullptr, 0).load();
+        }
+
+        return TriMeshLoader(path, file.data(), file.size()).load();
     }
 
-    boost::optional<Intersection> TriMeshObject::find_intersection(const Ray& r) const {
-        auto intersection = this->m_mesh->find_intersection(r);
+    boost::optional<Hit> TriMeshObject::find_hit(const Ray& r, float max_distance) const {
+        return this->m_mesh->find_hit(r, max_distance);
+    }
 
-        if (intersection) {
-            intersection->material(this->material().get());
-        }
+    void TriMeshObject::find_hits(
+        const RayPacket& p,
+        float* max_distances,
+        boost::optional<Hit>* hits
+    ) const {
+        this->m_mesh->find_hits(p, max_distances, hits);
+    }
+
+    Intersection TriMeshObject::intersection(const Ray& r, const Hit& hit) const {
+        return this->m_mesh->intersection(r, hit).material(this->material().get());
+    }
 
-        return intersection;
+    bool TriMeshObject::occludes(const Ray& r, float max_distance) const {
+        return this->m_mesh->occludes(r, max_distance);
     }
 }
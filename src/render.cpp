@@ -173,14 +173,25 @@ namespace hw4 {
         glm::ivec2 size
     ) const {
         Image img(size);
+        std::vector<glm::vec3> colors(size.x * size.y);
+
+        if (this->m_use_packets) {
+            this->render_patch_packets(scene, inv_view_matrix, start, size, colors);
+        } else {
+            for (int y = 0; y < size.y; y++) {
+                for (int x = 0; x < size.x; x++) {
+                    colors[x + y * size.x] = this->render_pixel(
+                        scene,
+                        inv_view_matrix,
+                        start + glm::ivec2(x, y)
+                    );
+                }
+            }
+        }
 
         for (int y = 0; y < size.y; y++) {
             for (int x = 0; x < size.x; x++) {
-                auto color = this->render_pixel(
-                    scene,
-                    inv_view_matrix,
-                    start + glm::ivec2(x, y)
-                );
+                auto color = colors[x + y * size.x];
 
                 // Perform gamma correction
                 color = glm::vec3(
@@ -196,6 +207,90 @@ namespace hw4 {
         return img;
     }
 
+    void RayTraceRenderer::render_patch_packets(
+        const Scene& scene,
+        const glm::mat4& inv_view_matrix,
+        glm::ivec2 start,
+        glm::ivec2 size,
+        std::vector<glm::vec3>& colors
+    ) const {
+        // The samples taken for every pixel in the patch form a single grid, which is split into
+        // square blocks that are each traced as a single packet.
+        constexpr int packet_dim = 8;
+        static_assert(packet_dim * packet_dim <= RayPacket::max_size, "Packets are too small");
+
+        auto samples = size * this->m_supersample_level;
+        std::vector<glm::vec3> sample_colors(samples.x * samples.y);
+
+        RayPacket packet;
+        glm::ivec2 positions[RayPacket::max_size];
+        float depths[RayPacket::max_size];
+        Intersection intersections[RayPacket::max_size];
+
+        for (int by = 0; by < samples.y; by += packet_dim) {
+            for (int bx = 0; bx < samples.x; bx += packet_dim) {
+                packet.clear();
+
+                for (int y = by; y < std::min(by + packet_dim, samples.y); y++) {
+                    for (int x = bx; x < std::min(bx + packet_dim, samples.x); x++) {
+                        auto pixel = glm::ivec2(x, y) / this->m_supersample_level;
+                        auto sample = glm::ivec2(x, y) - pixel * this->m_supersample_level;
+
+                        positions[packet.size()] = glm::ivec2(x, y);
+                        packet.add(this->primary_ray(inv_view_matrix, start + pixel, sample));
+                    }
+                }
+
+                this->find_intersections(scene, packet, depths, intersections);
+
+                if (this->m_max_recursion < 0) continue;
+
+                for (size_t i = 0; i < packet.size(); i++) {
+                    if (depths[i] == std::numeric_limits<float>::infinity()) continue;
+
+                    sample_colors[positions[i].x + positions[i].y * samples.x] = this->shade(
+                        scene,
+                        packet[i],
+                        intersections[i],
+                        0
+                    );
+                }
+            }
+        }
+
+        // Samples are summed in the same order as render_pixel would so that the result doesn't
+        // depend on which path was taken
+        for (int y = 0; y < size.y; y++) {
+            for (int x = 0; x < size.x; x++) {
+                glm::vec3 result;
+
+                for (int sy = 0; sy < this->m_supersample_level; sy++) {
+                    for (int sx = 0; sx < this->m_supersample_level; sx++) {
+                        auto pos = glm::ivec2(x, y) * this->m_supersample_level + glm::ivec2(sx, sy);
+
+                        result += sample_colors[pos.x + pos.y * samples.x];
+                    }
+                }
+
+                colors[x + y * size.x] = result * this->m_sample_mult;
+            }
+        }
+    }
+
+    Ray RayTraceRenderer::primary_ray(
+        const glm::mat4& inv_view_matrix,
+        glm::ivec2 ipos,
+        glm::ivec2 sample
+    ) const {
+        auto pos = -glm::vec3(
+            ipos.x + this->m_sample_spacing * (sample.x + 1) - this->m_size.x / 2,
+            ipos.y + this->m_sample_spacing * (sample.y + 1) - this->m_size.y / 2,
+            this->m_img_plane_distance
+        );
+
+        return inv_view_matrix * Ray::between(glm::vec3(0), pos);
+    }
+
     glm::vec3 RayTraceRenderer::render_pixel(
         const Scene& scene,
         const glm::mat4& inv_view_matrix,
@@ -205,15 +300,9 @@ namespace hw4 {
 
         for (int y = 0; y < this->m_supersample_level; y++) {
             for (int x = 0; x < this->m_supersample_level; x++) {
-                auto pos = -glm::vec3(
-                    ipos.x + this->m_sample_spacing * (x + 1) - this->m_size.x / 2,
-                    ipos.y + this->m_sample_spacing * (y + 1) - this->m_size.y / 2,
-                    this->m_img_plane_distance
-                );
-
                 result += this->render_ray(
                     scene,
-                    inv_view_matrix * Ray::between(glm::vec3(0), pos)
+                    this->primary_ray(inv_view_matrix, ipos, glm::ivec2(x, y))
                 );
             }
         }
@@ -221,96 +310,199 @@ namespace hw4 {
         return result * this->m_sample_mult;
     }
 
-    glm::vec3 RayTraceRenderer::render_ray(
+    bool RayTraceRenderer::find_intersection(
         const Scene& scene,
         const Ray& ray,
-        int recursion
+        Intersection& i
     ) const {
-        if (recursion > this->m_max_recursion) return glm::vec3(0);
-
         float depth = std::numeric_limits<float>::infinity();
-        Intersection i;
+        const ScenePrimitive* closest = nullptr;
+        Hit closest_hit;
 
-        scene.bvh().search(ray, [&](auto& o) {
-            float dist_mult;
-            Ray obj_ray = ray.transform(o.inv_transform(), dist_mult);
-            boost::optional<Intersection> intersection = o.find_intersection(obj_ray);
+        scene.bvh().search_closest(ray, depth, [&](auto& p) {
+            boost::optional<Hit> hit = scene.find_world_hit(p, ray, depth);
+
+            if (hit && hit->distance() < depth) {
+                depth = hit->distance();
+                closest = &p;
+                closest_hit = *hit;
+            }
+        });
 
-            if (!intersection) return;
+        if (!closest) return false;
 
-            float new_depth = intersection->distance() * dist_mult;
+        // Only the closest hit needs its normal, texture coordinates and material worked out
+        i = scene.object(*closest).world_intersection(ray, closest_hit);
+
+        return true;
+    }
+
+    void RayTraceRenderer::find_intersections(
+        const Scene& scene,
+        const RayPacket& packet,
+        float* depths,
+        Intersection* intersections
+    ) const {
+        RayPacket obj_packet;
+        size_t indices[RayPacket::max_size];
+        float dist_mults[RayPacket::max_size];
+        float obj_depths[RayPacket::max_size];
+        boost::optional<Hit> obj_hits[RayPacket::max_size];
+        const ScenePrimitive* closest[RayPacket::max_size] = {};
+        Hit closest_hits[RayPacket::max_size];
+
+        std::fill(depths, depths + packet.size(), std::numeric_limits<float>::infinity());
+
+        scene.bvh().search_closest_packet(packet, depths, [&](auto& p, uint64_t mask) {
+            // Spheres are tested in world space, so there's nothing to share between the rays
+            if (p.kind == ObjectKind::sphere) {
+                for (size_t i = 0; i < packet.size(); i++) {
+                    if ((mask & (static_cast<uint64_t>(1) << i)) == 0) continue;
+
+                    boost::optional<Hit> hit = scene.find_world_hit(p, packet[i], depths[i]);
+
+                    if (hit && hit->distance() < depths[i]) {
+                        depths[i] = hit->distance();
+                        closest[i] = &p;
+                        closest_hits[i] = *hit;
+                    }
+                }
 
-            if (new_depth < depth) {
-                depth = intersection->distance() * dist_mult;
-                i = intersection->transform(o.transform(), dist_mult);
+                return;
             }
-        });
 
-        if (depth != std::numeric_limits<float>::infinity()) {
-            auto mat = i.material();
-            auto result = glm::vec3();
+            const Object& o = scene.object(p);
+
+            obj_packet.clear();
+
+            for (size_t i = 0; i < packet.size(); i++) {
+                if ((mask & (static_cast<uint64_t>(1) << i)) == 0) continue;
+
+                size_t j = obj_packet.size();
 
-            for (const auto& plight : scene.point_lights()) {
-                result += this->render_point_light(scene, ray, i, mat, *plight);
+                indices[j] = i;
+                obj_packet.add(o.to_object_space(packet[i], dist_mults[j]));
+                obj_depths[j] = depths[i] / dist_mults[j];
             }
 
-            if (mat.transmittance > 0) {
-                auto normal = i.normal();
-                auto refractive_index = mat.refractive_index;
+            o.find_hits(obj_packet, obj_depths, obj_hits);
 
-                if (glm::dot(ray.direction(), i.normal()) < 0) {
-                    refractive_index = 1 / refractive_index;
-                } else {
-                    normal = -normal;
-                }
+            for (size_t j = 0; j < obj_packet.size(); j++) {
+                if (!obj_hits[j]) continue;
 
-                auto refracted = glm::refract(ray.direction(), normal, refractive_index);
+                size_t i = indices[j];
+                float new_depth = obj_hits[j]->t * dist_mults[j];
 
-                if (!std::isnan(refracted.x)) {
-                    result += mat.transmittance * this->render_ray(
-                        scene,
-                        Ray(
-                            i.point() - normal * this->m_bias,
-                            refracted
-                        ),
-                        recursion + 1
-                    );
-                } else {
-                    mat.reflectance += mat.transmittance;
+                if (new_depth < depths[i]) {
+                    depths[i] = new_depth;
+                    closest[i] = &p;
+                    closest_hits[i] = *obj_hits[j];
                 }
             }
+        });
 
-            if (mat.reflectance > 0) {
-                // Normally, we wouldn't have to worry about reflection with the normal in the same
-                // direction as the incident ray, but we do have to worry about this for objects
-                // with refracted rays, since they can reflect from inside the object.
-                if (glm::dot(i.normal(), ray.direction()) < 0) {
-                    result += mat.reflectance * this->render_ray(
-                        scene,
-                        Ray(
-                            i.point() + i.normal() * this->m_bias,
-                            glm::reflect(ray.direction(), i.normal())
-                        ),
-                        recursion + 1
-                    );
-                } else {
-                    result += mat.reflectance * this->render_ray(
-                        scene,
-                        Ray(
-                            i.point() - i.normal() * this->m_bias,
-                            glm::reflect(ray.direction(), i.normal())
-                        ),
-                        recursion + 1
-                    );
-                }
+        // Other than for spheres, the hits were found in object space, so they have to be turned
+        // into intersections there too
+        for (size_t i = 0; i < packet.size(); i++) {
+            if (!closest[i]) continue;
+
+            const Object& o = scene.object(*closest[i]);
+
+            if (closest[i]->kind == ObjectKind::sphere) {
+                intersections[i] = o.world_intersection(packet[i], closest_hits[i]);
+                continue;
             }
 
-            return result;
+            float dist_mult;
+            Ray obj_ray = o.to_object_space(packet[i], dist_mult);
+
+            intersections[i] = o.to_world_space(o.intersection(obj_ray, closest_hits[i]), dist_mult);
+        }
+    }
+
+    glm::vec3 RayTraceRenderer::render_ray(
+        const Scene& scene,
+        const Ray& ray,
+        int recursion
+    ) const {
+        if (recursion > this->m_max_recursion) return glm::vec3(0);
+
+        Intersection i;
+
+        if (this->find_intersection(scene, ray, i)) {
+            return this->shade(scene, ray, i, recursion);
         } else {
             return glm::vec3(0);
         }
     }
 
+    glm::vec3 RayTraceRenderer::shade(
+        const Scene& scene,
+        const Ray& ray,
+        const Intersection& i,
+        int recursion
+    ) const {
+        auto mat = i.material();
+        auto result = glm::vec3();
+
+        for (const auto& plight : scene.point_lights()) {
+            result += this->render_point_light(scene, ray, i, mat, *plight);
+        }
+
+        if (mat.transmittance > 0) {
+            auto normal = i.normal();
+            auto refractive_index = mat.refractive_index;
+
+            if (glm::dot(ray.direction(), i.normal()) < 0) {
+                refractive_index = 1 / refractive_index;
+            } else {
+                normal = -normal;
+            }
+
+            auto refracted = glm::refract(ray.direction(), normal, refractive_index);
+
+            if (!std::isnan(refracted.x)) {
+                result += mat.transmittance * this->render_ray(
+                    scene,
+                    Ray(
+                        i.point() - normal * this->m_bias,
+                        refracted
+                    ),
+                    recursion + 1
+                );
+            } else {
+                mat.reflectance += mat.transmittance;
+            }
+        }
+
+        if (mat.reflectance > 0) {
+            // Normally, we wouldn't have to worry about reflection with the normal in the same
+            // direction as the incident ray, but we do have to worry about this for objects
+            // with refracted rays, since they can reflect from inside the object.
+            if (glm::dot(i.normal(), ray.direction()) < 0) {
+                result += mat.reflectance * this->render_ray(
+                    scene,
+                    Ray(
+                        i.point() + i.normal() * this->m_bias,
+                        glm::reflect(ray.direction(), i.normal())
+                    ),
+                    recursion + 1
+                );
+            } else {
+                result += mat.reflectance * this->render_ray(
+                    scene,
+                    Ray(
+                        i.point() - i.normal() * this->m_bias,
+                        glm::reflect(ray.direction(), i.normal())
+                    ),
+                    recursion + 1
+                );
+            }
+        }
+
+        return result;
+    }
+
     glm::vec3 RayTraceRenderer::render_point_light(
         const Scene& scene,
         const Ray& ray,
@@ -347,17 +539,13 @@ namespace hw4 {
         float dist = glm::distance(from, to);
         float visibility = 1;
 
-        // TODO Optimize this
-        scene.bvh().search(ray, [&](auto& o) {
-            float dist_mult;
-            Ray obj_ray = ray.transform(o.inv_transform(), dist_mult);
-            boost::optional<Intersection> intersection = o.find_intersection(obj_ray);
-
-            if (!intersection) return;
-
-            if (intersection->distance() * dist_mult <= dist) {
-                visibility *= (1 - intersection->material().opacity);
+        scene.bvh().search_any(ray, dist, [&](auto& p) {
+            if (scene.world_occludes(p, ray, dist)) {
+                visibility *= (1 - scene.object(p).material()->opacity());
             }
+
+            // Once the light is fully blocked, nothing else along the ray can change the result.
+            return visibility <= 0;
         });
 
         return visibility;
@@ -1,3 +1,4 @@
+#include <future>
 #include <map>
 #include <sstream>
 
@@ -8,14 +9,46 @@
 #include "scene.hpp"
 
 namespace hw4 {
+    // Meshes and textures are loaded asynchronously as soon as their directives are seen, so that
+    // they load in parallel with each other and with parsing the rest of the scene file. Anything
+    // which needs a loaded asset is finished off once the whole file has been read.
     class SceneLoader {
+        template <typename T>
+        using AssetFuture = std::shared_future<std::shared_ptr<T>>;
+
+        // A material whose textures are still loading. Objects already refer to the material, so
+        // it's filled in place once its textures are ready.
+        struct PendingMaterial {
+            std::shared_ptr<Material> material;
+            Material base;
+            AssetFuture<Texture2D> diffuse_texture;
+            AssetFuture<Texture2D> ao_texture;
+        };
+
+        // A mesh object whose model is still loading, to be created in the given slot of the
+        // scene's objects so that objects stay in the order they were defined in
+        struct PendingMeshObject {
+            size_t index;
+            AssetFuture<TriMesh> mdl;
+            glm::mat4 transform;
+            std::shared_ptr<Material> mtl;
+        };
+
         Scene* m_scene;
         std::istream* m_stream;
         boost::filesystem::path m_dir;
+        const MeshCache* m_mesh_cache;
 
-        std::map<std::string, std::shared_ptr<TriMesh>> m_models;
+        std::map<std::string, AssetFuture<TriMesh>> m_models;
         std::map<std::string, std::shared_ptr<Material>> m_materials;
 
+        // Declared before anything holding futures for textures, so that loads still in progress
+        // are waited for before the cache goes away if loading fails part way through
+        TextureCache m_textures;
+
+        std::vector<PendingMaterial> m_pending_materials;
+        std::vector<PendingMeshObject> m_pending_objects;
+
         size_t m_current_line_number = 0;
         std::vector<std::string> m_current_line;
         size_t m_current_indent;
@@ -31,22 +64,37 @@ namespace hw4 {
         std::string parse_string_attr(const std::string& name);
         boost::filesystem::path parse_path_attr(const std::string& name);
 
+        AssetFuture<Texture2D> load_texture(const std::string& path);
+
         void parse_mdl();
         void parse_mtl();
         void parse_plight();
         void parse_obj_mesh();
         void parse_obj_sphere();
         void parse_camera();
+
+        void finish();
     public:
         SceneLoader(
             Scene* scene,
             std::istream* stream,
-            boost::filesystem::path dir
-        ) : m_scene(scene), m_stream(stream), m_dir(dir) {}
+            boost::filesystem::path dir,
+            const MeshCache* mesh_cache
+        ) : m_scene(scene), m_stream(stream), m_dir(dir), m_mesh_cache(mesh_cache) {}
 
         void load();
     };
 
+    template <typename TFn>
+    static auto load_async(TFn fn) {
+        return std::async(std::launch::async, std::move(fn)).share();
+    }
+
+    template <typename T>
+    static std::shared_ptr<T> get_asset(const std::shared_future<std::shared_ptr<T>>& f) {
+        return f.valid() ? f.get() : nullptr;
+    }
+
     static size_t count_indentation(const std::string& line) {
         size_t indentation = 0;
 
@@ -185,13 +233,22 @@ namespace hw4 {
             });
         }
 
-        this->m_models[this->m_current_line[1]] = TriMesh::load_mesh(
-            this->resolve_path(this->m_current_line[2])
-        );
+        auto path = this->resolve_path(this->m_current_line[2]);
+        auto mesh_cache = this->m_mesh_cache;
+
+        this->m_models[this->m_current_line[1]] = load_async([path, mesh_cache]() {
+            return mesh_cache ? mesh_cache->load_mesh(path) : TriMesh::load_mesh(path);
+        });
 
         this->read_next_line();
     }
 
+    SceneLoader::AssetFuture<Texture2D> SceneLoader::load_texture(const std::string& path) {
+        auto textures = &this->m_textures;
+
+        return load_async([textures, path]() { return textures->load(path); });
+    }
+
     void SceneLoader::parse_mtl() {
         if (this->m_current_line.size() != 2) {
             throw this->syntax_error([&](auto& ss) {
@@ -213,8 +270,8 @@ namespace hw4 {
         auto specular = glm::vec3(1);
         float shininess = 1;
 
-        std::shared_ptr<Texture2D> diffuse_texture;
-        std::shared_ptr<Texture2D> ao_texture;
+        AssetFuture<Texture2D> diffuse_texture;
+        AssetFuture<Texture2D> ao_texture;
 
         float opacity = 1;
 
@@ -245,9 +302,11 @@ namespace hw4 {
                 } else if (cmd == "refractive_index") {
                     refractive_index = this->parse_float_attr("mtl::refractive_index");
                 } else if (cmd == "diffuse_map") {
-                    diffuse_texture = Texture2D::load(this->parse_path_attr("mtl::diffuse_map").string());
+                    diffuse_texture = this->load_texture(
+                        this->parse_path_attr("mtl::diffuse_map").string()
+                    );
                 } else if (cmd == "ao_map") {
-                    ao_texture = Texture2D::load(this->parse_path_attr("mtl::ao_map").string());
+                    ao_texture = this->load_texture(this->parse_path_attr("mtl::ao_map").string());
                 } else {
                     throw this->syntax_error([&](auto& ss) {
                         ss << "Invalid mtl attribute \"" << cmd << "\"";
@@ -256,21 +315,27 @@ namespace hw4 {
             } while(this->read_next_line() && this->m_current_indent == indent);
         }
 
-        this->m_materials[name] = std::make_shared<Material>(
-            Material::textured(
-                Material::translucent(
-                    Material::reflective(
-                        Material::diffuse(ambient, diffuse, specular, shininess),
-                        reflectance
-                    ),
-                    opacity,
-                    transmittance,
-                    refractive_index
-                ),
+        auto base = Material::translucent(
+            Material::reflective(
+                Material::diffuse(ambient, diffuse, specular, shininess),
+                reflectance
+            ),
+            opacity,
+            transmittance,
+            refractive_index
+        );
+        auto material = std::make_shared<Material>(base);
+
+        if (diffuse_texture.valid() || ao_texture.valid()) {
+            this->m_pending_materials.push_back(PendingMaterial {
+                material,
+                base,
                 diffuse_texture,
                 ao_texture
-            )
-        );
+            });
+        }
+
+        this->m_materials[name] = material;
     }
 
     void SceneLoader::parse_plight() {
@@ -324,7 +389,7 @@ namespace hw4 {
     void SceneLoader::parse_obj_mesh() {
         size_t indent = this->m_current_indent;
 
-        std::shared_ptr<TriMesh> mdl;
+        AssetFuture<TriMesh> mdl;
         std::shared_ptr<Material> mtl;
 
         glm::vec3 pos;
@@ -377,13 +442,14 @@ namespace hw4 {
             throw this->syntax_error([&](auto& ss) {
                 ss << "Attribute obj::mtl is required";
             });
-        } else if (!mdl) {
+        } else if (!mdl.valid()) {
             throw this->syntax_error([&](auto& ss) {
                 ss << "Attribute obj::mdl is required for mesh objects";
             });
         }
 
-        this->m_scene->objects().push_back(std::make_unique<TriMeshObject>(
+        this->m_pending_objects.push_back(PendingMeshObject {
+            this->m_scene->objects().size(),
             mdl,
             apply_orientation(
                 glm::scale(
@@ -393,7 +459,8 @@ namespace hw4 {
                 rot
             ),
             mtl
-        ));
+        });
+        this->m_scene->objects().push_back(nullptr);
     }
 
     void SceneLoader::parse_obj_sphere() {
@@ -496,6 +563,31 @@ namespace hw4 {
         this->m_scene->cameras().emplace(name, Camera(pos, look_at, up, glm::radians(hfov)));
     }
 
+    void SceneLoader::finish() {
+        for (const auto& m : this->m_models) {
+            this->m_scene->models()[m.first] = m.second.get();
+        }
+
+        for (const auto& m : this->m_pending_materials) {
+            *m.material = Material::textured(
+                m.base,
+                get_asset(m.diffuse_texture),
+                get_asset(m.ao_texture)
+            );
+        }
+
+        for (const auto& o : this->m_pending_objects) {
+            this->m_scene->objects()[o.index] = std::make_unique<TriMeshObject>(
+                o.mdl.get(),
+                o.transform,
+                o.mtl
+            );
+        }
+
+        this->m_pending_materials.clear();
+        this->m_pending_objects.clear();
+    }
+
     void SceneLoader::load() {
         if (!this->read_next_line()) {
             return;
@@ -542,9 +634,11 @@ namespace hw4 {
                 });
             }
         }
+
+        this->finish();
     }
 
-    Scene Scene::load_scene(boost::filesystem::path path) {
+    Scene Scene::load_scene(boost::filesystem::path path, const MeshCache* mesh_cache) {
         boost::filesystem::ifstream f(path);
 
         if (!f) {
@@ -558,7 +652,7 @@ namespace hw4 {
         }
 
         Scene scene;
-        SceneLoader loader(&scene, &f, path.parent_path());
+        SceneLoader loader(&scene, &f, path.parent_path(), mesh_cache);
 
         loader.load();
 
@@ -1,24 +1,54 @@
+#include <algorithm>
 #include <cmath>
+#include <fstream>
+#include <iterator>
 #include <sstream>
 
+#include <boost/filesystem/operations.hpp>
 #include <stb_image.h>
 
+#include "hash.hpp"
 #include "texture.hpp"
 
 namespace hw4 {
-    std::shared_ptr<Texture2D> Texture2D::load(const std::string& path) {
-        int width, height, channels;
+    static std::runtime_error texture_read_error(const std::string& path) {
+        std::ostringstream ss;
+        ss << "Failed to read texture from file " << path;
 
-        unsigned char* data = stbi_load(path.c_str(), &width, &height, &channels, 3);
+        return std::runtime_error(ss.str());
+    }
 
-        if (data == nullptr) {
-            throw std::runtime_error(([&]() {
-                std::ostringstream ss;
-                ss << "Failed to read texture from file " << path;
+    static std::vector<unsigned char> read_texture_file(const std::string& path) {
+        std::ifstream f(path, std::ios::binary);
 
-                return ss.str();
-            })());
-        }
+        if (!f) throw texture_read_error(path);
+
+        std::vector<unsigned char> data(
+            (std::istreambuf_iterator<char>(f)),
+            std::istreambuf_iterator<char>()
+        );
+
+        if (f.bad()) throw texture_read_error(path);
+
+        return data;
+    }
+
+    std::shared_ptr<Texture2D> Texture2D::decode(
+        const std::vector<unsigned char>& encoded,
+        const std::string& path
+    ) {
+        int width, height, channels;
+
+        unsigned char* data = stbi_load_from_memory(
+            encoded.data(),
+            static_cast<int>(encoded.size()),
+            &width,
+            &height,
+            &channels,
+            3
+        );
+
+        if (data == nullptr) throw texture_read_error(path);
 
         auto data_copy = std::make_unique<glm::vec3[]>(width * height);
 
@@ -38,4 +68,84 @@ namespace hw4 {
 
         return std::make_shared<Texture2D>(glm::ivec2(width, height), std::move(data_copy));
     }
+
+    std::shared_ptr<Texture2D> Texture2D::load(const std::string& path) {
+        return Texture2D::decode(read_texture_file(path), path);
+    }
+
+    std::shared_ptr<Texture2D> TextureCache::load(const std::string& path) {
+        auto path_key = boost::filesystem::absolute(path).lexically_normal().string();
+
+        std::promise<std::shared_ptr<Texture2D>> promise;
+        TextureFuture existing;
+        TextureFuture own;
+
+        {
+            std::lock_guard<std::mutex> lock(this->m_mutex);
+            auto it = this->m_by_path.find(path_key);
+
+            if (it != this->m_by_path.end()) {
+                existing = it->second;
+            } else {
+                own = promise.get_future().share();
+                this->m_by_path.emplace(path_key, own);
+            }
+        }
+
+        if (existing.valid()) return existing.get();
+
+        // Whatever happens, the promise has to be fulfilled so that nobody waiting on this path
+        // waits forever
+        try {
+            auto data = read_texture_file(path);
+            auto contents_key = std::make_pair(
+                Hasher().add(data.data(), data.size()).hash(),
+                data.size()
+            );
+            std::string existing_path;
+
+            {
+                std::lock_guard<std::mutex> lock(this->m_mutex);
+                auto it = this->m_by_contents.find(contents_key);
+
+                if (it != this->m_by_contents.end()) {
+                    existing_path = it->second.path;
+                    existing = it->second.texture;
+                } else {
+                    this->m_by_contents.emplace(contents_key, ContentsEntry { path, own });
+                }
+            }
+
+            // Files whose hashes collide without having the same contents just get a texture of
+            // their own. The entry already in the table is left alone, since other paths may be
+            // sharing it. Matches are rare, so the other file is just read again rather than
+            // keeping the contents of every texture around.
+            if (existing.valid()) {
+                bool same;
+
+                try {
+                    auto existing_data = read_texture_file(existing_path);
+
+                    same = std::equal(
+                        data.begin(),
+                        data.end(),
+                        existing_data.begin(),
+                        existing_data.end()
+                    );
+                } catch (std::runtime_error&) {
+                    same = false;
+                }
+
+                if (!same) existing = TextureFuture();
+            }
+
+            auto texture = existing.valid() ? existing.get() : Texture2D::decode(data, path);
+
+            promise.set_value(texture);
+            return texture;
+        } catch (...) {
+            promise.set_exception(std::current_exception());
+            throw;
+        }
+    }
 }